@@ -0,0 +1,120 @@
+// riko4-bench, runs scripts/usr/bin/bench.lua against the gpu, image, speaker
+// and fs libraries without a window or audio device and prints its CSV
+// results to stdout.
+//
+//   riko4-bench [scripts dir] [bench args...]
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+#include "SDL_gpu/SDL_gpu.h"
+
+#include "luaIncludes.h"
+
+#include "rikoGPU.h"
+#include "rikoImage.h"
+#include "rikoAudio.h"
+#include "rikoFs.h"
+#include "headless.h"
+
+// Normally provided by riko.cpp, the gpu library only touches these when it
+// has a window, which the benchmark never creates
+GPU_Target *renderer = NULL;
+GPU_Image *buffer = NULL;
+int pixelSize = 1;
+int afPixscale = 1;
+bool shaderOn = false;
+bool audEnabled = false;
+int audVoices = 32;
+char *scriptsPath = NULL;
+
+void quitRiko(int code) {
+    exit(code);
+}
+
+static double perfFreq;
+static Uint64 perfStart;
+
+static int benchClock(lua_State *L) {
+    lua_pushnumber(L, (double)(SDL_GetPerformanceCounter() - perfStart) / perfFreq);
+    return 1;
+}
+
+// Mirrors the native path of write in boot.lua. There is no window, so
+// gpu.swap only counts frames and bench.lua leaves out its swap case.
+static const char *prelude =
+    "local dir = ...\n"
+    "benchNoWindow = true\n"
+    "local f = assert(io.open(dir .. '/smol.rff', 'rb'))\n"
+    "gpu.setFont(gpu.newFont(f:read('*a')))\n"
+    "f:close()\n"
+    "write = function(t, x, y, col, target)\n"
+    "  t = tostring(t)\n"
+    "  if target then target:drawText(t, x + 1, y + 1, col or 16)\n"
+    "  else gpu.drawText(t, x + 1, y + 1, col or 16) end\n"
+    "end\n";
+
+int main(int argc, char *argv[]) {
+    const char *scriptDir = argc > 1 ? argv[1] : "scripts";
+
+    // fs sandboxes paths to scriptsPath, which needs to be absolute like the
+    // one riko.cpp builds from the app path
+#ifdef _WIN32
+    scriptsPath = _fullpath(NULL, scriptDir, 0);
+#else
+    scriptsPath = realpath(scriptDir, NULL);
+#endif
+    if (scriptsPath == NULL) {
+        fprintf(stderr, "Unable to find scripts directory '%s'\n", scriptDir);
+        return 1;
+    }
+
+    headless = true;
+    perfFreq = (double)SDL_GetPerformanceFrequency();
+    perfStart = SDL_GetPerformanceCounter();
+
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    luaopen_gpu(L);
+    luaopen_image(L);
+    luaopen_aud(L);
+    luaopen_fs(L);
+    lua_settop(L, 0);
+
+    lua_getglobal(L, "os");
+    lua_pushcfunction(L, benchClock);
+    lua_setfield(L, -2, "clock");
+    lua_pop(L, 1);
+
+    if (luaL_loadstring(L, prelude) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_pushstring(L, scriptDir);
+    if (lua_pcall(L, 1, 0, 0) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/usr/bin/bench.lua", scriptDir);
+    if (luaL_loadfile(L, path) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+    }
+    if (lua_pcall(L, argc > 2 ? argc - 2 : 0, 0, 0) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    lua_close(L);
+    return 0;
+}
@@ -7,6 +7,7 @@ varying vec2 texCoord;
 uniform sampler2D tex;
 uniform vec2 resolution;
 uniform bool crteffect;
+uniform vec3 palette[16];
 
 const float gamma = 1.;
 const float contrast = 1.;
@@ -16,6 +17,18 @@ const float brightness = 1.;
 const float light = 9.;
 const float blur = 1.5;
 
+// The screen texture holds palette indices, resolve them to a color
+vec3 texel(in vec2 uv) {
+    int index = int(texture2D(tex, uv).r * 255. + .5);
+
+    vec3 col = palette[0];
+    for (int i = 1; i < 16; i++) {
+        if (i == index) col = palette[i];
+    }
+
+    return col;
+}
+
 vec3 postEffects(in vec3 rgb, in vec2 xy) {
     rgb = pow(rgb, vec3(gamma));
     rgb = mix(vec3(.5), mix(vec3(dot(vec3(.2125, .7154, .0721), rgb*brightness)), rgb*brightness, saturation), contrast);
@@ -29,17 +42,17 @@ vec3 gaussian(in vec2 ncuv, in vec2 rs) {
 
     ncuv+= .5;
 
-    vec3 col = texture2D(tex, vec2(ncuv.x - b/rs.x, ncuv.y - b/rs.y) ).rgb * 0.077847;
-    col += texture2D(tex, vec2(ncuv.x - b/rs.x, ncuv.y) ).rgb * 0.123317;
-    col += texture2D(tex, vec2(ncuv.x - b/rs.x, ncuv.y + b/rs.y) ).rgb * 0.077847;
+    vec3 col = texel(vec2(ncuv.x - b/rs.x, ncuv.y - b/rs.y)) * 0.077847;
+    col += texel(vec2(ncuv.x - b/rs.x, ncuv.y)) * 0.123317;
+    col += texel(vec2(ncuv.x - b/rs.x, ncuv.y + b/rs.y)) * 0.077847;
 
-    col += texture2D(tex, vec2(ncuv.x, ncuv.y - b/rs.y) ).rgb * 0.123317;
-    col += texture2D(tex, vec2(ncuv.x, ncuv.y) ).rgb * 0.195346;
-    col += texture2D(tex, vec2(ncuv.x, ncuv.y + b/rs.y) ).rgb * 0.123317;
+    col += texel(vec2(ncuv.x, ncuv.y - b/rs.y)) * 0.123317;
+    col += texel(vec2(ncuv.x, ncuv.y)) * 0.195346;
+    col += texel(vec2(ncuv.x, ncuv.y + b/rs.y)) * 0.123317;
 
-    col += texture2D(tex, vec2(ncuv.x + b/rs.x, ncuv.y - b/rs.y) ).rgb * 0.077847;
-    col += texture2D(tex, vec2(ncuv.x + b/rs.x, ncuv.y) ).rgb * 0.123317;
-    col += texture2D(tex, vec2(ncuv.x + b/rs.x, ncuv.y + b/rs.y) ).rgb * 0.077847;
+    col += texel(vec2(ncuv.x + b/rs.x, ncuv.y - b/rs.y)) * 0.077847;
+    col += texel(vec2(ncuv.x + b/rs.x, ncuv.y)) * 0.123317;
+    col += texel(vec2(ncuv.x + b/rs.x, ncuv.y + b/rs.y)) * 0.077847;
 
     return col;
 }
@@ -103,6 +116,6 @@ void main(void)
 
         gl_FragColor = vec4(max(vec3(.0), min(vec3(1.), color)), 1.);
     } else {
-        gl_FragColor = texture2D(tex, texCoord) * color;
+        gl_FragColor = vec4(texel(texCoord), 1.) * color;
     }
 }
\ No newline at end of file
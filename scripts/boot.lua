@@ -65,10 +65,22 @@ gpu.font = coreFont
 
 
 write = function(t, x, y, col, target)
-  local fnt = gpu.font.data
+  local font = gpu.font
+  local fnt = font.data
 
   t = tostring(t)
   col = col or 16
+
+  if font.native then
+    gpu.setFont(font.native)
+    if target then
+      target:drawText(t, x + 1, y + 1, col)
+    else
+      gpu.drawText(t, x + 1, y + 1, col)
+    end
+    return
+  end
+
   local xoff = 0
   for i=1, #t do
     local text = t:sub(i, i)
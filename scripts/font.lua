@@ -195,7 +195,7 @@ function font.encodeFromImage(image, stchar, echar)
 end
 
 function font.new(fontdata)
-  local t = {data = font.parseFontdata2(fontdata)}
+  local t = {data = font.parseFontdata2(fontdata), native = gpu.newFont(fontdata)}
   setmetatable(t, {__index = font})
 
   return t
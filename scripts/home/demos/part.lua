@@ -102,9 +102,19 @@ local partCyc = {
 local ship = {0, 0, -3 * math.pi / 4, 0, 0}
 local missiles = {}
 
-local fbo = {}
-for i = 1, sw * sh do
-  fbo[i] = 1
+-- Particle layer, blitted straight from native memory every frame. The web
+-- build has no FFI, there it falls back to a table indexed from 1.
+local hasFFI, ffi = pcall(require, "ffi")
+
+local fbo, fboPtr, fboBase
+if hasFFI then
+  fbo = ffi.new("uint8_t[?]", sw * sh)
+  fboPtr = ffi.cast("uint8_t *", fbo)
+  fboBase = 0
+else
+  fbo = {}
+  fboPtr = fbo
+  fboBase = 1
 end
 
 local stars = {}
@@ -291,8 +301,12 @@ local function draw()
     gpu.drawPixel(x, y, 16)
   end
 
-  for i = 1, sw * sh do
-    fbo[i] = 0
+  if hasFFI then
+    ffi.fill(fbo, sw * sh)
+  else
+    for i = 1, sw * sh do
+      fbo[i] = 0
+    end
   end
 
   for i = 1, #parts do
@@ -305,7 +319,7 @@ local function draw()
         local yv = fl(part[2] - offsetY) + k - 1
         if xv <= sw and xv >= 1 and yv <= sh and yv >= 1 then
           if stage[(k - 1) * h + j] == 1 then
-            local index = xv + (yv - 1) * sw
+            local index = xv + (yv - 1) * sw - 1 + fboBase
             local prev = fbo[index]
             if part[6] == 1 then
               fbo[index] = pmap[prev] or pmap[0]
@@ -318,7 +332,7 @@ local function draw()
     end
   end
 
-  gpu.blitPixels(0, 0, sw, sh, fbo)
+  gpu.blitPixels(0, 0, sw, sh, fboPtr)
 
   local verts = {
     {0, -3},
@@ -2,10 +2,33 @@ local gpp = {}
 
 local gpuDrawPixel = gpu.drawPixel
 local gpuDrawRectangle = gpu.drawRectangle
+local gpuDrawPixels = gpu.drawPixels
+local gpuDrawRectangles = gpu.drawRectangles
 local gpuBlitImage = function(a, ...)
   a:render(...)
 end
 
+-- Shapes the target can rasterize itself, the Lua versions below are only
+-- used for targets without them
+local nativeShapes = {"drawLine", "drawCircle", "fillCircle", "drawEllipse", "fillEllipse", "fillPolygon"}
+local native = {}
+
+-- Image methods are bound to the Image, every native shape takes at most five
+-- arguments after it
+local function bindNative(targetBuffer, selfInd)
+  for i = 1, #nativeShapes do
+    local name = nativeShapes[i]
+    local f = targetBuffer[name]
+    if f and selfInd then
+      native[name] = function(a, b, c, d, e) return f(targetBuffer, a, b, c, d, e) end
+    else
+      native[name] = f
+    end
+  end
+end
+
+bindNative(gpu, false)
+
 local gpuWidth = gpu.width
 local gpuHeight = gpu.height
 
@@ -17,23 +40,82 @@ local function round(n)
   end
 end
 
+-- Shapes are collected into flat batches and submitted in one call
+local rectBatch, rectCount = {}, 0
+local pixBatch, pixCount = {}, 0
+
+local function batchRect(x, y, w, h, c)
+  local n = rectCount * 5
+  rectBatch[n + 1] = x
+  rectBatch[n + 2] = y
+  rectBatch[n + 3] = w
+  rectBatch[n + 4] = h
+  rectBatch[n + 5] = c
+  rectCount = rectCount + 1
+end
+
+local function batchPixel(x, y, c)
+  local n = pixCount * 3
+  pixBatch[n + 1] = x
+  pixBatch[n + 2] = y
+  pixBatch[n + 3] = c
+  pixCount = pixCount + 1
+end
+
+-- The Image gpp draws into when targeted with gpp.target(image, true)
+local targetImage
+
+local function flushRects()
+  if targetImage then
+    targetImage:drawRectangles(rectBatch, rectCount)
+  elseif gpuDrawRectangles then
+    gpuDrawRectangles(rectBatch, rectCount)
+  else
+    for i = 0, rectCount - 1 do
+      local n = i * 5
+      gpuDrawRectangle(rectBatch[n + 1], rectBatch[n + 2], rectBatch[n + 3], rectBatch[n + 4], rectBatch[n + 5])
+    end
+  end
+  rectCount = 0
+end
+
+local function flushPixels()
+  if targetImage then
+    targetImage:drawPixels(pixBatch, pixCount)
+  elseif gpuDrawPixels then
+    gpuDrawPixels(pixBatch, pixCount)
+  else
+    for i = 0, pixCount - 1 do
+      local n = i * 3
+      gpuDrawPixel(pixBatch[n + 1], pixBatch[n + 2], pixBatch[n + 3])
+    end
+  end
+  pixCount = 0
+end
+
 function gpp.target(targetBuffer, selfInd)
   if selfInd then
-    gpuDrawPixel = function(...) targetBuffer:drawPixel(...) end
-    gpuDrawRectangle = function(...) targetBuffer:drawRectangle(...) end
-    gpuBlitImage = function(a, ...)
-      a:copy(targetBuffer, ...)
+    targetImage = targetBuffer
+    -- Takes render's argument order, copy wants the size before the source offset
+    gpuBlitImage = function(a, x, y, sx, sy, w, h)
+      a:copy(targetBuffer, x, y, w or a:getWidth(), h or a:getHeight(), sx or 0, sy or 0)
     end
   else
+    targetImage = nil
     gpuDrawPixel = targetBuffer.drawPixel
     gpuDrawRectangle = targetBuffer.drawRectangle
+    gpuDrawPixels = targetBuffer.drawPixels
+    gpuDrawRectangles = targetBuffer.drawRectangles
     gpuBlitImage = function(a, ...)
       a:render(...)
     end
   end
+  bindNative(targetBuffer, selfInd)
 end
 
 function gpp.fillEllipse(x0, y0, rx, ry, c)
+  if native.fillEllipse then return native.fillEllipse(x0, y0, rx, ry, c) end
+
   local twoASquare = 2 * rx * rx
   local twoBSquare = 2 * ry * ry
   local x = rx
@@ -45,8 +127,8 @@ function gpp.fillEllipse(x0, y0, rx, ry, c)
   local stopY = 0
 
   while stopX >= stopY do
-    gpuDrawRectangle(x0 - x, y0 + y, 2 * x + 1, 1, c)
-    gpuDrawRectangle(x0 - x, y0 - y, 2 * x + 1, 1, c)
+    batchRect(x0 - x, y0 + y, 2 * x + 1, 1, c)
+    batchRect(x0 - x, y0 - y, 2 * x + 1, 1, c)
 
     y = y + 1
     stopY = stopY + twoASquare
@@ -70,8 +152,8 @@ function gpp.fillEllipse(x0, y0, rx, ry, c)
   stopY = twoASquare * ry
 
   while stopX <= stopY do
-    gpuDrawRectangle(x0 - x, y0 + y, 2 * x + 1, 1, c)
-    gpuDrawRectangle(x0 - x, y0 - y, 2 * x + 1, 1, c)
+    batchRect(x0 - x, y0 + y, 2 * x + 1, 1, c)
+    batchRect(x0 - x, y0 - y, 2 * x + 1, 1, c)
 
     x = x + 1
     stopX = stopX + twoBSquare
@@ -85,9 +167,12 @@ function gpp.fillEllipse(x0, y0, rx, ry, c)
       dy = dy + twoASquare
     end
   end
+  flushRects()
 end
 
 function gpp.drawEllipse(x0, y0, rx, ry, c)
+  if native.drawEllipse then return native.drawEllipse(x0, y0, rx, ry, c) end
+
   local twoASquare = 2 * rx * rx
   local twoBSquare = 2 * ry * ry
   local x = rx
@@ -99,10 +184,10 @@ function gpp.drawEllipse(x0, y0, rx, ry, c)
   local stopY = 0
 
   while stopX >= stopY do
-    gpuDrawPixel(x0 + x, y0 + y, c)
-    gpuDrawPixel(x0 - x, y0 + y, c)
-    gpuDrawPixel(x0 - x, y0 - y, c)
-    gpuDrawPixel(x0 + x, y0 - y, c)
+    batchPixel(x0 + x, y0 + y, c)
+    batchPixel(x0 - x, y0 + y, c)
+    batchPixel(x0 - x, y0 - y, c)
+    batchPixel(x0 + x, y0 - y, c)
 
     y = y + 1
     stopY = stopY + twoASquare
@@ -126,10 +211,10 @@ function gpp.drawEllipse(x0, y0, rx, ry, c)
   stopY = twoASquare * ry
 
   while stopX <= stopY do
-    gpuDrawPixel(x0 + x, y0 + y, c)
-    gpuDrawPixel(x0 - x, y0 + y, c)
-    gpuDrawPixel(x0 - x, y0 - y, c)
-    gpuDrawPixel(x0 + x, y0 - y, c)
+    batchPixel(x0 + x, y0 + y, c)
+    batchPixel(x0 - x, y0 + y, c)
+    batchPixel(x0 - x, y0 - y, c)
+    batchPixel(x0 + x, y0 - y, c)
 
     x = x + 1
     stopX = stopX + twoBSquare
@@ -143,19 +228,22 @@ function gpp.drawEllipse(x0, y0, rx, ry, c)
       dy = dy + twoASquare
     end
   end
+  flushPixels()
 end
 
 function gpp.fillCircle(x0, y0, r, c)
+  if native.fillCircle then return native.fillCircle(x0, y0, r, c) end
+
   local x = r
   local y = 0
   local err = 0
 
   while x >= y do
-    gpuDrawRectangle(x0 - x, y0 + y, 2 * x + 1, 1, c)
-    gpuDrawRectangle(x0 - y, y0 + x, 2 * y + 1, 1, c)
+    batchRect(x0 - x, y0 + y, 2 * x + 1, 1, c)
+    batchRect(x0 - y, y0 + x, 2 * y + 1, 1, c)
 
-    gpuDrawRectangle(x0 - x, y0 - y, 2 * x + 1, 1, c)
-    gpuDrawRectangle(x0 - y, y0 - x, 2 * y + 1, 1, c)
+    batchRect(x0 - x, y0 - y, 2 * x + 1, 1, c)
+    batchRect(x0 - y, y0 - x, 2 * y + 1, 1, c)
 
     y = y + 1
     if err <= 0 then
@@ -165,9 +253,20 @@ function gpp.fillCircle(x0, y0, r, c)
       err = err + 2 * (y - x) + 1
     end
   end
+  flushRects()
+end
+
+-- The fallback traces an ellipse, which steps differently from the native
+-- midpoint circle
+function gpp.drawCircle(x0, y0, r, c)
+  if native.drawCircle then return native.drawCircle(x0, y0, r, c) end
+
+  gpp.drawEllipse(x0, y0, r, r, c)
 end
 
 function gpp.drawLine(x1, y1, x2, y2, c)
+  if native.drawLine then return native.drawLine(x1, y1, x2, y2, c) end
+
   local deltaX = x2 - x1
   local deltaY = y2 - y1
 
@@ -181,7 +280,7 @@ function gpp.drawLine(x1, y1, x2, y2, c)
       deltaY = y2 - y1
     end
 
-    local ddY = deltaY > 1 and 1 or -1
+    local ddY = deltaY > 0 and 1 or -1
 
     local deltaErr = 2 * deltaY * ddY - deltaX
 
@@ -192,14 +291,14 @@ function gpp.drawLine(x1, y1, x2, y2, c)
       min = x < min and x or min
 
       if deltaErr > 0 then
-        gpuDrawRectangle(min, y, x - min + 1, 1, c)
+        batchRect(min, y, x - min + 1, 1, c)
         min = math.huge
         y = y + ddY
         deltaErr = deltaErr - deltaX
       end
       deltaErr = deltaErr + deltaY * ddY
     end
-    gpuDrawRectangle(min, y, x2 - min + 1, 1, c)
+    batchRect(min, y, x2 - min + 1, 1, c)
   else
     if y1 > y2 then
       local tx, ty = x1, y1
@@ -210,7 +309,7 @@ function gpp.drawLine(x1, y1, x2, y2, c)
       deltaY = y2 - y1
     end
 
-    local ddX = deltaX > 1 and 1 or -1
+    local ddX = deltaX > 0 and 1 or -1
 
     local deltaErr = 2 * deltaX * ddX - deltaY
 
@@ -221,18 +320,21 @@ function gpp.drawLine(x1, y1, x2, y2, c)
       min = y < min and y or min
 
       if deltaErr > 0 then
-        gpuDrawRectangle(x, min, 1, y - min + 1, c)
+        batchRect(x, min, 1, y - min + 1, c)
         min = math.huge
         x = x + ddX
         deltaErr = deltaErr - deltaY
       end
       deltaErr = deltaErr + deltaX * ddX
     end
-    gpuDrawRectangle(x, min, 1, y2 - min + 1, c)
+    batchRect(x, min, 1, y2 - min + 1, c)
   end
+  flushRects()
 end
 
 function gpp.fillPolygon(poly, c)
+  if native.fillPolygon and type(c) == "number" then return native.fillPolygon(poly, c) end
+
   local pixelX, pixelY, i, j, swap
   local nodes, nodeX = 0, {}
 
@@ -282,18 +384,28 @@ function gpp.fillPolygon(poly, c)
     --  Fill the pixels between node pairs.
     for i = 1, nodes - 1, 2 do
       if   (nodeX[i    ] >= gpuWidth) then break end
-      if   (nodeX[i + 1] >  0 ) then
+      if   (nodeX[i + 1] >= 0 ) then
         if (nodeX[i    ] <  0 ) then nodeX[i] = 0 end
         if (nodeX[i + 1] >  gpuWidth) then nodeX[i + 1] = gpuWidth end
 
         if typeNum then
-          gpuDrawRectangle(nodeX[i], pixelY, round(nodeX[i + 1] - nodeX[i] + 1), 1, c)
+          batchRect(nodeX[i], pixelY, round(nodeX[i + 1] - nodeX[i] + 1), 1, c)
         else
           gpuBlitImage(c, nodeX[i], pixelY, nodeX[i], pixelY, round(nodeX[i + 1] - nodeX[i] + 1), 1)
         end
       end
     end
   end
+
+  flushRects()
+end
+
+function gpp.drawPolygon(poly, c)
+  local n = #poly
+  for i = 1, n do
+    local p, q = poly[i], poly[i % n + 1]
+    gpp.drawLine(p[1], p[2], q[1], q[2], c)
+  end
 end
 
 return gpp
@@ -20,27 +20,19 @@ do
     g_.translate(-x, -y)
   end
 
-  local sprSheet = image.newImage(8, 8)
+  local sprSheet = image.newSpriteSheet(image.newImage(8, 8), 8)
   local sheetWidth = 1
-  local sheetMargin = 0
-  local sprArea = 8
-  local sprSpacing = 0
 
   function sheet(file, a, m, s)
-    sprArea = a or 8
-    sprSpacing = s or 0
-    sheetMargin = m or 0
-
-    local sw, sh
-    sprSheet, sw, sh = rif.createImage(file)
-    sheetWidth = (sw - sheetMargin * 2 + sprSpacing) / (sprArea + sprSpacing)
+    local img = rif.createImage(file)
+    sprSheet = image.newSpriteSheet(img, a or 8, a or 8, m or 0, s or 0)
+    sheetWidth = sprSheet:getSize()
   end
 
-  function spr(x, y, dx, dy)
-    sprSheet:render(dx, dy,
-      sheetMargin + (x - 1) * (sprArea + sprSpacing),
-      sheetMargin + (y - 1) * (sprArea + sprSpacing),
-      sprArea, sprArea)
+  function spr(x, y, dx, dy, flip)
+    if x >= 1 and x <= sheetWidth then
+      sprSheet:draw((y - 1) * sheetWidth + x, dx, dy, flip)
+    end
   end
 
   function rect(x, y, w, h, c)
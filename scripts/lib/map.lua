@@ -90,6 +90,7 @@ function maputils.attachSpritesheet(map, sprSht, margin, spacing)
   
   map.sheets[#map.sheets + 1] = {
     image = sprSht,
+    native = image.newSpriteSheet(sprSht, map.mapMeta.tileWidth, map.mapMeta.tileHeight, margin, spacing),
     width = (w - margin * 2 + spacing) / (map.mapMeta.tileWidth + spacing),
     height = (h - margin * 2 + spacing) / (map.mapMeta.tileHeight + spacing),
     margin = margin,
@@ -97,6 +98,9 @@ function maputils.attachSpritesheet(map, sprSht, margin, spacing)
   }
 end
 
+-- Tiles are collected per sheet and drawn with one drawMany call per sheet
+local batches, batchCounts = {}, {}
+
 function maputils.render(map, dx, dy, sx, sy, w, h, remap)
   local mw, mh = map.mapMeta.mapWidth, map.mapMeta.mapHeight
   w = w or math.huge
@@ -118,22 +122,32 @@ function maputils.render(map, dx, dy, sx, sy, w, h, remap)
 
     local px, py = dx + layerOffsetX, dy + layerOffsetY
 
+    for s = 1, #map.sheets do
+      batches[s] = batches[s] or {}
+      batchCounts[s] = 0
+    end
+
     for x = sx + 1, mw do
       for y = sy + 1, mh do
         local tile = layerData[x][y]
         
-        if tile[1] > 0 then
-          local sheet = map.sheets[tile[2]]
-          local tx = (tile[1] - 1) % sheet.width + 1
-          local ty = math.floor((tile[1] - 1) / sheet.width) + 1
-
-          sheet.image:render(px + (x - 1) * sprW, py + (y - 1) * sprH,
-            sheet.margin + (tx - 1) * (sprW + sheet.spacing),
-            sheet.margin + (ty - 1) * (sprH + sheet.spacing),
-            sprW, sprH)
+        if tile[1] > 0 and map.sheets[tile[2]] then
+          local s = tile[2]
+          local batch = batches[s]
+          local n = batchCounts[s] * 4
+
+          batch[n + 1] = tile[1]
+          batch[n + 2] = px + (x - 1) * sprW
+          batch[n + 3] = py + (y - 1) * sprH
+          batch[n + 4] = 0
+          batchCounts[s] = batchCounts[s] + 1
         end
       end
     end
+
+    for s = 1, #map.sheets do
+      map.sheets[s].native:drawMany(batches[s], batchCounts[s])
+    end
   end
 end
 
@@ -11,7 +11,7 @@ local version = 2
 local stub = "RIV"
 -- Encodes a RIF string from a 1D or 2D array of colors
 function rif.encode(pixels, w, h)
-  local output = stub
+  local header = stub
   .. string.char(version) -- RIF Version
   .. string.char(  bit.rshift(bit.band(w, 65280), 8)  )  -- width/256
   .. string.char(  bit.band(w, 255)                   )  -- width/1
@@ -20,6 +20,8 @@ function rif.encode(pixels, w, h)
   .. string.char(1) -- Transparency flag
   .. (string.char(0)):rep(10) -- Leave extra room for future headers
 
+  -- Collected in a table, appending to a string per byte is quadratic
+  local output = {header}
 
   local transmap = {}
   if tonumber(pixels[1]) then
@@ -43,7 +45,7 @@ function rif.encode(pixels, w, h)
       sp = sp <= 0 and 0 or sp - 1
 
       local cstr = bit.bor(bit.lshift(fp, 4), sp)
-      output = output .. string.char(cstr)
+      output[#output + 1] = string.char(cstr)
     end
   else
     local pad = false
@@ -77,7 +79,7 @@ function rif.encode(pixels, w, h)
       sp = sp < 0 and 0 or sp
 
       local cstr = bit.bor(bit.lshift(fp, 4), sp)
-      output = output .. string.char(cstr)
+      output[#output + 1] = string.char(cstr)
     end
   end
 
@@ -96,7 +98,7 @@ function rif.encode(pixels, w, h)
     end
   end
 
-  return output .. table.concat(bytes, "")
+  return table.concat(output) .. table.concat(bytes, "")
 end
 
 -- Decodes a RIF to a 1D blit table
@@ -143,29 +145,23 @@ function rif.decode1D(rifData)
   return outTable, w, h
 end
 
--- Streamline process of loading images
+-- Streamline process of loading images, files and RIF strings are decoded natively
 function rif.createImage(filenameOrRifData, wa, ha)
-  local rifData, w, h
   if type(filenameOrRifData) == "table" then
-    rifData, w, h = filenameOrRifData, wa, ha
+    local img = image.newImage(wa, ha)
+    img:blitPixels(0, 0, wa, ha, filenameOrRifData)
+
+    return img, wa, ha
   elseif type(filenameOrRifData) == "string" then
-    local handle = fs.open(filenameOrRifData, "rb")
-    if not handle then
-      error("No such file", 2)
+    local ok, img, w, h = pcall(image.loadRIF, filenameOrRifData)
+    if not ok then
+      error(img, 2)
     end
-    local data = handle:read("*a")
-    handle:close()
 
-    rifData, w, h = rif.decode1D(data)
+    return img, w, h
   else
     error("Argument is not a filename or rifdata", 2)
   end
-
-  local image = image.newImage(w, h)
-  image:blitPixels(0, 0, w, h, rifData)
-  image:flush()
-
-  return image, w, h
 end
 
 return rif
\ No newline at end of file
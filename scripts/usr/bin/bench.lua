@@ -0,0 +1,254 @@
+--HELP: \b6Usage: \b16bench \b7[\b16-f frames\b7] [\b16-o file\b7] [\b16case\b7 ...] \n
+-- \b6Description: \b7Runs the graphics microbenchmarks and prints CSV results (ops/sec, ns/op and frame time percentiles). \b16-o \b7also writes them to \b16file
+
+local args = {...}
+
+local frames = 60
+local warmup = 5
+local outFile
+local only = {}
+
+local i = 1
+while i <= #args do
+  local a = args[i]
+  if a == "-f" then
+    frames = math.max(1, tonumber(args[i + 1]) or frames)
+    i = i + 1
+  elseif a == "-o" then
+    outFile = args[i + 1]
+    i = i + 1
+  else
+    only[a] = true
+  end
+  i = i + 1
+end
+
+local clock = os.clock
+local gw, gh = gpu.width, gpu.height
+
+local blitW, blitH = 64, 64
+local blitStr
+do
+  local bytes = {}
+  for j = 0, blitW * blitH - 1 do
+    bytes[#bytes + 1] = string.char(j % 16 + 1)
+  end
+  blitStr = table.concat(bytes)
+end
+
+local blitTbl = {}
+for j = 1, blitW * blitH do
+  blitTbl[j] = (j - 1) % 16 + 1
+end
+
+local img = image.newImage(blitW, blitH)
+img:blitPixels(0, 0, blitW, blitH, blitStr)
+
+-- A 256x256 sprite sheet with some transparency, plus a palette swapped copy
+local sheet = image.newImage(256, 256)
+local sheetRemap = image.newImage(256, 256)
+do
+  local bytes = {}
+  for j = 0, 256 * 256 - 1 do
+    bytes[#bytes + 1] = string.char(j % 5 == 0 and 0 or (j * 7) % 16 + 1)
+  end
+  bytes = table.concat(bytes)
+  sheet:blitPixels(0, 0, 256, 256, bytes)
+  sheetRemap:blitPixels(0, 0, 256, 256, bytes)
+  for c = 1, 16 do
+    sheetRemap:remap(c, 17 - c)
+  end
+end
+
+local sprites = image.newSpriteSheet(sheet, 8)
+local offscreen = image.newImage(128, 128)
+local spriteBatch = {}
+
+local text = "The quick brown fox jumps over the lazy dog"
+
+-- Each case draws a fixed workload of `ops` operations per frame
+local cases = {
+  {name = "drawPixel", ops = 20000, run = function(f)
+    local pix = gpu.drawPixel
+    for j = 0, 19999 do
+      pix(j % gw, (j / gw + f) % gh, j % 16 + 1)
+    end
+  end},
+  {name = "drawRectangle", ops = 2000, run = function(f)
+    local rect = gpu.drawRectangle
+    for j = 0, 1999 do
+      rect((j * 7) % gw, (j * 3 + f) % gh, 16, 16, j % 16 + 1)
+    end
+  end},
+  {name = "drawLine", ops = 1000, run = function(f)
+    local line = gpu.drawLine
+    for j = 0, 999 do
+      line((j * 7) % gw, (j * 3 + f) % gh, (j * 11 + f) % gw, (j * 5) % gh, j % 16 + 1)
+    end
+  end},
+  {name = "fillCircle", ops = 200, run = function(f)
+    local circ = gpu.fillCircle
+    for j = 0, 199 do
+      circ((j * 7) % gw, (j * 3 + f) % gh, j % 24, j % 16 + 1)
+    end
+  end},
+  {name = "fillPolygon", ops = 100, run = function(f)
+    local poly = {{0, 0}, {40, 8}, {28, 36}, {12, 30}}
+    for j = 0, 99 do
+      local ox, oy = (j * 13) % gw, (j * 5 + f) % gh
+      poly[1][1], poly[1][2] = ox, oy
+      poly[2][1], poly[2][2] = ox + 40, oy + 8
+      poly[3][1], poly[3][2] = ox + 28, oy + 36
+      poly[4][1], poly[4][2] = ox + 12, oy + 30
+      gpu.fillPolygon(poly, j % 16 + 1)
+    end
+  end},
+  {name = "blitPixels", ops = 100, run = function(f)
+    local blit = gpu.blitPixels
+    for j = 0, 99 do
+      blit((j * 13) % gw, (j * 5 + f) % gh, blitW, blitH, blitStr)
+    end
+  end},
+  {name = "blitPixelsTable", ops = 20, run = function(f)
+    local blit = gpu.blitPixels
+    for j = 0, 19 do
+      blit((j * 13) % gw, (j * 5 + f) % gh, blitW, blitH, blitTbl)
+    end
+  end},
+  {name = "image:render", ops = 200, run = function(f)
+    for j = 0, 199 do
+      img:render((j * 13) % gw, (j * 5 + f) % gh)
+    end
+  end},
+  {name = "image:render256", ops = 20, run = function(f)
+    for j = 0, 19 do
+      sheet:render(j % 24, -(f % 96))
+    end
+  end},
+  {name = "image:render256Remap", ops = 20, run = function(f)
+    for j = 0, 19 do
+      sheetRemap:render(j % 24, -(f % 96))
+    end
+  end},
+  {name = "image:renderEx", ops = 100, run = function(f)
+    local opts = {sx = 1.5, sy = 1.5, rotation = f * 3, originX = 32, originY = 32, flipX = f % 2 == 0}
+    for j = 0, 99 do
+      img:renderEx((j * 13) % gw, (j * 5) % gh, opts)
+    end
+  end},
+  {name = "sheet:drawMany", ops = 2000, run = function(f)
+    for j = 0, 1999 do
+      local n = j * 4
+      spriteBatch[n + 1] = j % 1024 + 1
+      spriteBatch[n + 2] = (j * 8) % gw
+      spriteBatch[n + 3] = (math.floor(j * 8 / gw) * 8 + f) % gh
+      spriteBatch[n + 4] = j % 4
+    end
+    sprites:drawMany(spriteBatch, 2000)
+  end},
+  {name = "image:blitPixels", ops = 100, run = function(f)
+    for j = 0, 99 do
+      img:blitPixels(0, 0, blitW, blitH, blitStr)
+    end
+  end},
+  {name = "image.newScratch", ops = 200, run = function(f)
+    for j = 0, 199 do
+      local tmp = image.newScratch(32, 32)
+      tmp:clear()
+      img:copy(tmp, 0, 0, 32, 32, j % 32, f % 32)
+      tmp:render((j * 13) % gw, (j * 5 + f) % gh)
+      tmp:free()
+    end
+  end},
+  {name = "gpu.setTarget", ops = 200, run = function(f)
+    local rect = gpu.drawRectangle
+    gpu.setTarget(offscreen)
+    for j = 0, 199 do
+      rect((j * 7) % 128, (j * 3 + f) % 128, 16, 16, j % 16 + 1)
+    end
+    gpu.setTarget()
+    offscreen:render(f % 24, 0)
+  end},
+  {name = "write", ops = 200, run = function(f)
+    for j = 0, 199 do
+      write(text, (j * 3) % 40, (j * 7 + f) % gh, j % 16 + 1)
+    end
+  end},
+}
+
+-- riko4-bench has no window to present to, swap would only time a frame counter
+if not benchNoWindow then
+  cases[#cases + 1] = {name = "swap", ops = 1, swap = true, run = function(f)
+    gpu.swap()
+  end}
+end
+
+-- Synth mixing, rendered offline so it runs at full speed. The first five
+-- channels each get a long sliding note, ops are mixed samples.
+cases[#cases + 1] = {name = "speaker.render", ops = 4096, run = function(f)
+  if f == 1 then
+    for c = 1, 5 do
+      speaker.play({channel = c, frequency = 110 * c, shift = 220, time = 3600, attack = 1, release = 1, volume = 0.2})
+    end
+  end
+
+  speaker.render(4096 / 48000)
+end}
+
+local function percentile(sorted, q)
+  local idx = math.max(1, math.ceil(q * #sorted))
+  return sorted[idx]
+end
+
+local lines = {"case,ops,ops_per_sec,ns_per_op,frame_p50_ms,frame_p95_ms,frame_p99_ms"}
+print(lines[1])
+
+for _, case in ipairs(cases) do
+  if not next(only) or only[case.name] then
+    local times = {}
+    local total = 0
+
+    for f = 1, warmup + frames do
+      -- The swap case measures swap alone, so the frame it presents is drawn untimed
+      if case.swap then
+        gpu.clear(f % 16 + 1)
+      end
+
+      local t = clock()
+      case.run(f)
+      local dt = clock() - t
+
+      if not case.swap then
+        gpu.swap()
+      end
+
+      if f > warmup then
+        times[#times + 1] = dt
+        total = total + dt
+      end
+    end
+
+    table.sort(times)
+
+    local ops = case.ops * frames
+    local line = string.format("%s,%d,%.0f,%.1f,%.3f,%.3f,%.3f", case.name, ops,
+      ops / total, total / ops * 1e9,
+      percentile(times, 0.5) * 1000, percentile(times, 0.95) * 1000, percentile(times, 0.99) * 1000)
+
+    lines[#lines + 1] = line
+    print(line)
+  end
+end
+
+img:free()
+sheet:free()
+sheetRemap:free()
+offscreen:free()
+
+speaker.stopAll()
+
+if outFile then
+  local handle = fs.open(outFile, "w")
+  handle:write(table.concat(lines, "\n") .. "\n")
+  handle:close()
+end
@@ -383,6 +383,15 @@ local function convertScrn2I(x, y)
   return math.floor((x - drawOffX) / zoomFactor), math.floor((y - drawOffY - 10) / zoomFactor)
 end
 
+-- Updates a single canvas pixel, 0 is transparent
+local function setPixel(tx, ty, c)
+  if c == 0 then
+    dispImage:clear(tx, ty, 1, 1)
+  else
+    dispImage:drawPixel(tx, ty, c)
+  end
+end
+
 local function drawQ(x, y, b)
   if b == 2 then
     return
@@ -390,9 +399,9 @@ local function drawQ(x, y, b)
 
   local tx, ty = convertScrn2I(x, y)
   if tx >= 0 and ty >= 0 and tx < imgWidth and ty < imgHeight and (b == 1 or b == 3)then
-    workingImage[tx + 1][ty + 1] = (b == 1) and primColor or (b == 3) and secColor
-    dispImage:blitPixels(0, 0, imgWidth, imgHeight, toBlitTable(workingImage))
-    dispImage:flush()
+    local c = (b == 1) and primColor or (b == 3) and secColor
+    workingImage[tx + 1][ty + 1] = c
+    setPixel(tx, ty, c)
   end
 end
 
@@ -405,15 +414,13 @@ local function floodFill(x, y, c)
     local pop = table.remove(fillQueue, #fillQueue)
     local px, py = pop[1], pop[2]
     workingImage[px][py] = c
+    setPixel(px - 1, py - 1, c)
 
     if px < imgWidth  and workingImage[px + 1][py] == control then fillQueue[#fillQueue + 1] = {px + 1, py} end
     if px > 1         and workingImage[px - 1][py] == control then fillQueue[#fillQueue + 1] = {px - 1, py} end
     if py < imgHeight and workingImage[px][py + 1] == control then fillQueue[#fillQueue + 1] = {px, py + 1} end
     if py > 1         and workingImage[px][py - 1] == control then fillQueue[#fillQueue + 1] = {px, py - 1} end
   end
-
-  dispImage:blitPixels(0, 0, imgWidth, imgHeight, toBlitTable(workingImage))
-  dispImage:flush()
 end
 
 local closeHover = false
@@ -500,9 +507,7 @@ local toolList = {
       local tx, ty = convertScrn2I(x, y)
       if tx >= 0 and ty >= 0 and tx < imgWidth and ty < imgHeight and b == 1 then
         workingImage[tx + 1][ty + 1] = 0
-        dispImage:clear()
-        dispImage:blitPixels(0, 0, imgWidth, imgHeight, toBlitTable(workingImage))
-        dispImage:flush()
+        setPixel(tx, ty, 0)
       end
     end,
     mouseUp = function(x, y, b)
@@ -516,9 +521,7 @@ local toolList = {
         local tx, ty = convertScrn2I(x, y)
         if tx >= 0 and ty >= 0 and tx < imgWidth and ty < imgHeight then
           workingImage[tx + 1][ty + 1] = 0
-          dispImage:clear()
-          dispImage:blitPixels(0, 0, imgWidth, imgHeight, toBlitTable(workingImage))
-          dispImage:flush()
+          setPixel(tx, ty, 0)
         end
       end
     end,
@@ -1147,9 +1150,7 @@ local function processEvent(ev, p1, p2, p3, p4)
       for i = 1, clipboard.w do
         for j = 1, clipboard.h do
           workingImage[i + tx][j + ty] = clipboard.data[i][j]
-          dispImage:clear()
-          dispImage:blitPixels(0, 0, imgWidth, imgHeight, toBlitTable(workingImage))
-          dispImage:flush()
+          setPixel(i + tx - 1, j + ty - 1, clipboard.data[i][j])
         end
       end
 
@@ -1,20 +1,42 @@
+#define _CRT_SECURE_NO_WARNINGS
 #define LUA_LIB
 
 #define PI 3.141592654
 #define TAO PI * 2
 
 #include "rikoAudio.h"
+#include "rikoFs.h"
+#include "rikoConsts.h"
+#include "wav.h"
 
 #include "luaIncludes.h"
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <math.h>
 
+#if !defined(__EMSCRIPTEN__) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  define RIKO_MIX_SSE2
+#  include <emmintrin.h>
+#endif
+
 extern bool audEnabled;
+extern int audVoices;
+
+enum {
+    WAVE_PULSE,
+    WAVE_TRIANGLE,
+    WAVE_SAW,
+    WAVE_NOISE,
+    WAVE_SINE
+};
+
+static const char *waveformNames[] = { "pulse", "triangle", "saw", "noise", "sine", NULL };
 
 typedef struct {
     double totalTime;
@@ -24,252 +46,824 @@ typedef struct {
     double attack;
     double release;
     float volume;
+    int waveform;
+    float duty;
+    // Sample clock frame to start on, notes that are late start right away
+    uint64_t startAt;
 } Sound;
 
-typedef struct node {
-    Sound* data;
-    struct node* next;
-} node_t;
+SDL_AudioSpec want, have;
+SDL_AudioDeviceID dev;
+
+static int sampleRate = 48000;
+static int samples = 1024;
+static int audDevChanCount = 1;
+
+// Every voice is a channel with its own note queue, how many is set by
+// voices in config.lua. The first five keep the waveforms they always had
+// when play doesn't name one.
+#define MAX_VOICES 64
+const int fixedChannels = 5;
+const int queueSize = 512;
+
+static const int channelWaveforms[fixedChannels] = { WAVE_PULSE, WAVE_PULSE, WAVE_TRIANGLE, WAVE_SAW, WAVE_NOISE };
+
+static int voiceCount = 32;
+
+// Notes travel from aud.play to the audio thread through one fixed size single
+// producer, single consumer ring per channel. Only the Lua thread moves write
+// and only the audio thread moves read, both count up freely and are masked
+// into the ring, so neither side locks or touches the allocator. Stopping a
+// channel publishes flushTo, the audio thread then drops every note from
+// before that point, including the one it is playing. The audio thread
+// publishes done as it finishes notes, the channel is idle once it reaches
+// write.
+typedef struct {
+    Sound notes[queueSize];
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+    SDL_atomic_t flushTo;
+    SDL_atomic_t done;
+} noteRing;
+
+// The voice each channel plays its current note on, owned by the audio thread.
+// Phase is a fraction of a cycle scaled to 2^64 so it wraps by itself, inc is
+// the per sample step and incShift how much that step changes every sample.
+typedef struct {
+    Sound sound;
+    unsigned int seq;
+    bool active;
+
+    uint64_t phase;
+    uint64_t inc;
+    int64_t incShift;
+    uint64_t dutyPhase;
+
+    double noisePhase;
+    float noiseHold;
+    uint32_t noiseState;
+} Voice;
+
+static noteRing noteRings[MAX_VOICES];
+static Voice voices[MAX_VOICES];
+
+// When each channel last got a note from play, stealing takes the oldest,
+// and the clock frame its queued notes should be done by. Only the Lua
+// thread uses these.
+static unsigned int playStamp[MAX_VOICES];
+static unsigned int playCounter;
+static uint64_t playEnd[MAX_VOICES];
+
+// Frames mixed since startup, the timeline at and speaker.now use. The audio
+// thread publishes the low half, the Lua thread carries the high half.
+static uint64_t mixClock;
+static SDL_atomic_t publishedClock;
+
+// Decoded sample data, shared by its Lua object and the voices playing it. The
+// audio thread only drops references, the Lua thread frees the data once its
+// object is collected and the count reaches zero.
+typedef struct pcmData {
+    float *frames;
+    uint32_t length;
+    int rate;
+    SDL_atomic_t refs;
+    struct pcmData *nextDead;
+} pcmData;
+
+typedef struct {
+    pcmData *data;
+} sampleType;
+
+// A file decoded on its own thread into a ring of frames as it plays, with
+// the same free running indices as the note rings. The decoder thread owns it
+// and frees it once the mixer sets released.
+#define STREAM_SIZE 65536
+#define STREAM_PREFILL 8192
+
+typedef struct {
+    wavReader wav;
+    float ring[STREAM_SIZE];
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+    SDL_atomic_t eof;
+    SDL_atomic_t released;
+    bool loop;
+} pcmStream;
+
+// Samples and streams play on their own small pool of voices. Position is in
+// frames as 32.32 fixed point, for streams only the fraction is kept and the
+// whole frames are consumed from the ring.
+#define SAMPLE_VOICES 16
+
+typedef struct {
+    int id;
+    pcmData *data;
+    pcmStream *stream;
+    float volume;
+    double pitch;
+    bool loop;
+    uint64_t startAt;
+    uint64_t pos;
+    uint64_t step;
+    unsigned int started;
+} sampleVoice;
+
+enum {
+    SAMPLE_PLAY,
+    SAMPLE_STOP
+};
+
+// Play and stop requests travel to the audio thread through one more single
+// producer ring, which picks and steals sample voices itself. Stopping id 0
+// stops them all.
+typedef struct {
+    int type;
+    int id;
+    pcmData *data;
+    pcmStream *stream;
+    float volume;
+    double pitch;
+    bool loop;
+    uint64_t startAt;
+} sampleCommand;
+
+#define COMMAND_SIZE 64
+
+static struct {
+    sampleCommand cmds[COMMAND_SIZE];
+    SDL_atomic_t read;
+    SDL_atomic_t write;
+} sampleCommands;
+
+static sampleVoice sampleVoices[SAMPLE_VOICES];
+static unsigned int sampleStarts;
+
+// Offline rendering, for speaker.render and --audio-file. The mixer runs on
+// the calling thread with the device locked, and streams wait for their
+// decoder instead of playing silence, so the output only depends on what
+// was played.
+static bool waitForStreams = false;
+static float renderBuffer[4096];
+
+// --audio-file records sampleRate / 60 frames for every gpu.swap
+static FILE *audioFile = NULL;
+static uint32_t audioFileFrames;
+static uint64_t audioFileSwaps;
+
+// Lua thread only, ids for playSample and stream, and collected samples that
+// voices still held
+static int lastSampleId;
+static pcmData *deadSamples;
+
+// Band limited single cycle tables, built once at startup. Level k holds the
+// first 1024 >> k harmonics, a note reads the richest level whose harmonics
+// all stay under Nyquist. Each table has a guard sample for interpolation.
+#define WAVE_BITS 11
+#define WAVE_SIZE (1 << WAVE_BITS)
+#define WAVE_LEVELS 11
+
+static float sawTables[WAVE_LEVELS][WAVE_SIZE + 1];
+static float triangleTables[WAVE_LEVELS][WAVE_SIZE + 1];
+static float sineTable[WAVE_SIZE + 1];
+
+// Voices render in blocks of at most this many samples
+#define MIX_BLOCK 256
+
+static float mixBuffer[MIX_BLOCK];
+static float voiceBuffer[MIX_BLOCK];
+
+// Sums the Fourier series of a rising saw (2 * frac(x) - 1) and of the
+// triangle (1 - 4 * |frac(x) - 0.5|), saving a level every time the harmonic
+// count reaches a power of two
+static void buildWavetables() {
+    static float saw[WAVE_SIZE];
+    static float triangle[WAVE_SIZE];
+    const float *sine = sineTable;
+
+    for (int n = 0; n < WAVE_SIZE; n++) {
+        sineTable[n] = (float)sin(TAO * n / WAVE_SIZE);
+        saw[n] = 0;
+        triangle[n] = 0;
+    }
+    sineTable[WAVE_SIZE] = sineTable[0];
+
+    int level = WAVE_LEVELS - 1;
+    for (int h = 1; h <= WAVE_SIZE / 2; h++) {
+        float sawGain = (float)(-2 / (PI * h));
+        float triangleGain = (h & 1) ? (float)(-8 / (PI * PI * h * h)) : 0;
+
+        for (int n = 0; n < WAVE_SIZE; n++) {
+            int idx = (h * n) & (WAVE_SIZE - 1);
+            saw[n] += sawGain * sine[idx];
+            triangle[n] += triangleGain * sine[(idx + WAVE_SIZE / 4) & (WAVE_SIZE - 1)];
+        }
+
+        if (h == (WAVE_SIZE / 2) >> level) {
+            memcpy(sawTables[level], saw, sizeof(saw));
+            memcpy(triangleTables[level], triangle, sizeof(triangle));
+            sawTables[level][WAVE_SIZE] = saw[0];
+            triangleTables[level][WAVE_SIZE] = triangle[0];
+            level--;
+        }
+    }
+}
+
+// Picks the level for a note moving between two frequencies
+static int waveLevel(double f0, double f1) {
+    double f = fabs(f0) > fabs(f1) ? fabs(f0) : fabs(f1);
+    double harmonics = sampleRate / 2 / (f > 1 ? f : 1);
+
+    int level = 0;
+    while (level < WAVE_LEVELS - 1 && (double)((WAVE_SIZE / 2) >> level) > harmonics) level++;
+    return level;
+}
+
+// Cycles per sample as a 2^64 phase step, negative steps wrap around
+static uint64_t toPhaseStep(double cycles) {
+    cycles = fmod(cycles, 1.0);
+    return (uint64_t)(int64_t)(cycles * 9223372036854775808.0) << 1;
+}
+
+static inline float waveAt(const float *table, uint64_t phase) {
+    uint32_t idx = (uint32_t)(phase >> (64 - WAVE_BITS));
+    float frac = (float)((phase >> (64 - WAVE_BITS - 16)) & 0xFFFF) * (1.0f / 65536);
+    return table[idx] + (table[idx + 1] - table[idx]) * frac;
+}
+
+// xorshift32, so noise needs neither rand() nor its lock
+static inline float noiseSample(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (float)(x >> 8) * (2.0f / 16777216) - 1;
+}
 
-typedef struct queue {
-    node_t* head;
-    node_t* tail;
-} queue_t;
+static bool ringPush(noteRing *ring, const Sound *snd) {
+    unsigned int w = (unsigned int)SDL_AtomicGet(&ring->write);
+    unsigned int r = (unsigned int)SDL_AtomicGet(&ring->read);
+    if (w - r >= (unsigned int)queueSize) return false;
 
-queue_t* constructQueue() {
-    queue_t* newQueue = (queue_t*)malloc(sizeof(queue_t));
-    newQueue->head = NULL;
-    newQueue->tail = NULL;
-    return newQueue;
+    ring->notes[w & (queueSize - 1)] = *snd;
+    SDL_AtomicSet(&ring->write, (int)(w + 1));
+    return true;
 }
 
-void pushToQueue(queue_t* wqueue, Sound* snd) {
-    node_t* nxtNode = (node_t*)malloc(sizeof(node_t));
-    nxtNode->data = snd;
-    nxtNode->next = NULL;
-    if (wqueue->head != NULL) 
-          wqueue->head->next = nxtNode;
-    else  wqueue->tail = nxtNode;
-    wqueue->head = nxtNode;
+static bool ringPop(noteRing *ring, Voice *voice) {
+    unsigned int r = (unsigned int)SDL_AtomicGet(&ring->read);
+    if (r == (unsigned int)SDL_AtomicGet(&ring->write)) return false;
+
+    voice->sound = ring->notes[r & (queueSize - 1)];
+    voice->seq = r;
+    voice->active = true;
+    SDL_AtomicSet(&ring->read, (int)(r + 1));
+
+    voice->inc = toPhaseStep(voice->sound.frequency / sampleRate);
+    voice->incShift = (int64_t)toPhaseStep(voice->sound.frequencyShift / sampleRate);
+    voice->dutyPhase = (uint64_t)(voice->sound.duty * 9223372036854775808.0) << 1;
+    return true;
 }
 
-Sound* popFromQueue(queue_t* wqueue) {
-    if (wqueue->tail == NULL) {
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Attempt to pop from empty queue (%p)", (void*)wqueue);
-        return NULL;
+// Applies a pending stop: skips the notes queued before it and silences the
+// voice if it is still playing one of them
+static void applyFlush(int i) {
+    noteRing *ring = &noteRings[i];
+    unsigned int f = (unsigned int)SDL_AtomicGet(&ring->flushTo);
+    unsigned int r = (unsigned int)SDL_AtomicGet(&ring->read);
+
+    if ((int)(f - r) > 0) {
+        SDL_AtomicSet(&ring->read, (int)f);
     }
-    Sound* data = wqueue->tail->data;
-    node_t* old = wqueue->tail;
-    if (old == wqueue->head) {
-        wqueue->head = NULL;
-        wqueue->tail = NULL;
-        free(old);
-        return data;
+    if (voices[i].active && (int)(voices[i].seq - f) < 0) {
+        voices[i].active = false;
+        voices[i].phase = 0;
+        voices[i].noisePhase = 0;
     }
-    wqueue->tail = wqueue->tail->next;
-    free(old);
-
-    return data;
 }
 
-void falloutQueue(queue_t* wqueue) {
-    if (wqueue->tail == NULL) {
-        if (wqueue->head != wqueue->tail) {
-            puts("WARN: Queue has dangling head! Some elements may not be freed correctly!\n");
-            free(wqueue->head);
+// Renders n raw samples of the voice's note into out
+static void renderWave(Voice *voice, float *out, int n) {
+    Sound *snd = &voice->sound;
+
+    if (snd->waveform == WAVE_NOISE) {
+        // Sample and hold noise, frequency is the hold period in samples here
+        for (int i = 0; i < n; i++) {
+            double period = snd->frequency > 1 ? snd->frequency : 1;
+            double next = voice->noisePhase + 1;
+            if (next >= period) {
+                next = fmod(next, period);
+                voice->noiseHold = noiseSample(&voice->noiseState);
+            }
+            voice->noisePhase = next;
+            out[i] = voice->noiseHold;
+            snd->frequency += snd->frequencyShift;
         }
         return;
     }
 
-    while (wqueue->tail->next != NULL) {
-        Sound* snd = popFromQueue(wqueue);
-        free(snd);
-
-        if (wqueue->tail == NULL) {
-            if (wqueue->head != wqueue->tail) {
-                puts("WARN: Queue has dangling head! Some elements may not be freed correctly!\n");
-                free(wqueue->head);
-            }
-            return;
+    double endFrequency = snd->frequency + snd->frequencyShift * n;
+    int level = waveLevel(snd->frequency, endFrequency);
+    snd->frequency = endFrequency;
+
+    const float *saw = sawTables[level];
+    uint64_t phase = voice->phase;
+    uint64_t inc = voice->inc;
+    uint64_t incShift = (uint64_t)voice->incShift;
+
+    switch (snd->waveform) {
+    case WAVE_PULSE: {
+        // A pulse is the difference of two saws a duty cycle apart, high for
+        // the first part of the cycle
+        const float duty = snd->duty;
+        const uint64_t dutyPhase = voice->dutyPhase;
+        for (int i = 0; i < n; i++) {
+            out[i] = waveAt(saw, phase - dutyPhase) - waveAt(saw, phase) + 2 * duty - 1;
+            phase += inc;
+            inc += incShift;
         }
+        break;
     }
+    case WAVE_SINE: {
+        for (int i = 0; i < n; i++) {
+            out[i] = waveAt(sineTable, phase);
+            phase += inc;
+            inc += incShift;
+        }
+        break;
+    }
+    case WAVE_TRIANGLE: {
+        const float *triangle = triangleTables[level];
+        for (int i = 0; i < n; i++) {
+            out[i] = waveAt(triangle, phase);
+            phase += inc;
+            inc += incShift;
+        }
+        break;
+    }
+    default: {
+        // Starts halfway up the ramp, matching the old 2 * fmod(phase - 0.5, 1) - 1
+        const uint64_t half = (uint64_t)1 << 63;
+        for (int i = 0; i < n; i++) {
+            out[i] = waveAt(saw, phase + half);
+            phase += inc;
+            inc += incShift;
+        }
+        break;
+    }
+    }
+
+    voice->phase = phase;
+    voice->inc = inc;
+}
 
-    if (wqueue->head != wqueue->tail) {
-        puts("WARN: Queue has dangling head/tail! Some elements may not be freed correctly!\n");
-        free(wqueue->head);
+// out += in * volume * attack * release, where the attack gain rises from a by
+// aInc per sample and the release gain falls from r by rInc, both capped at 1
+static void mixEnvelope(float *out, const float *in, int n, float volume, float a, float aInc, float r, float rInc) {
+    int i = 0;
+
+#ifdef RIKO_MIX_SSE2
+    const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 vol = _mm_set1_ps(volume);
+    const __m128 av = _mm_set1_ps(a), ai = _mm_set1_ps(aInc);
+    const __m128 rv = _mm_set1_ps(r), ri = _mm_set1_ps(rInc);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 idx = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(i), lanes));
+        __m128 at = _mm_min_ps(one, _mm_add_ps(av, _mm_mul_ps(idx, ai)));
+        __m128 rl = _mm_min_ps(one, _mm_sub_ps(rv, _mm_mul_ps(idx, ri)));
+        __m128 gain = _mm_mul_ps(vol, _mm_mul_ps(at, rl));
+        __m128 o = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), gain));
+        _mm_storeu_ps(out + i, o);
     }
+#endif
 
-    free(wqueue->tail);
+    for (; i < n; i++) {
+        float at = a + i * aInc;
+        float rl = r - i * rInc;
+        out[i] += in[i] * volume * (at < 1 ? at : 1) * (rl < 1 ? rl : 1);
+    }
 }
 
-SDL_AudioSpec want, have;
-SDL_AudioDeviceID dev;
+// Mixes n samples of the channel into out, starting at clock frame clock and
+// moving on to queued notes as the current one ends
+static void renderVoice(int chan, float *out, int n, uint64_t clock) {
+    Voice *voice = &voices[chan];
 
-static int sampleRate = 48000;
-static int samples = 1024;
-static int audDevChanCount = 1;
+    while (n > 0) {
+        if (!voice->active && !ringPop(&noteRings[chan], voice)) return;
 
-const int channelCount = 5;
-const int queueSize = 512;
-static queue* audioQueues[channelCount];
-static Sound* playingAudio[channelCount];
-static bool channelHasSnd[channelCount];
-static double streamPhase[channelCount];
-float lstRnd = 0;
-
-void audioCallback(void *userdata, uint8_t *byteStream, int len) {
-    float* floatStream = (float*) byteStream;
-
-    for (int i = 0; i < channelCount; i++) {
-        if (!channelHasSnd[i] && audioQueues[i]->tail != NULL) {
-            playingAudio[i] = popFromQueue(audioQueues[i]);
-            channelHasSnd[i] = true;
-        }
-    }
-
-    for (int z = 0; z < samples * audDevChanCount; z++) {
-        for (int cc = 0; cc < audDevChanCount; cc++) {
-            floatStream[z] = 0;
-
-            for (int i = 0; i < channelCount; i++) {
-                if (!channelHasSnd[i]) {
-                    if (audioQueues[i]->tail != NULL) {
-                        playingAudio[i] = popFromQueue(audioQueues[i]);
-                        channelHasSnd[i] = true;
-                    } else {
-                        continue;
-                    }
-                }
+        Sound *snd = &voice->sound;
+        if (snd->remainingCycles == 0) {
+            // Got another sound queued up, so load it in
+            if (!ringPop(&noteRings[chan], voice)) {
+                voice->active = false;
+                return;
+            }
+            continue;
+        }
 
-                if (playingAudio[i]->remainingCycles == 0) {
-                    free(playingAudio[i]);
+        // Silence up to the exact frame a scheduled note starts on
+        if (snd->startAt > clock) {
+            if (snd->startAt - clock >= (uint64_t)n) return;
 
-                    if (audioQueues[i]->tail != NULL) {
-                        // Awesome got another sound queued up, so load it in
-                        playingAudio[i] = popFromQueue(audioQueues[i]);
-                    } else {
-                        channelHasSnd[i] = false;
-                    }
-                }
+            int wait = (int)(snd->startAt - clock);
+            out += wait;
+            n -= wait;
+            clock += wait;
+        }
 
-                if (!channelHasSnd[i]) continue;
+        int len = snd->remainingCycles < (unsigned long long)n ? (int)snd->remainingCycles : n;
 
-                double delta;
-                double atC;
-                double rlC;
+        // Envelope gains at the first sample of the segment, worked out from
+        // the sample counts so they never drift
+        float a = 1, aInc = 0;
+        if (snd->attack != 0) {
+            aInc = (float)(1 / (snd->attack * sampleRate));
+            a = (float)((snd->totalTime * sampleRate - (double)snd->remainingCycles) * aInc);
+        }
 
-                if (playingAudio[i]->attack == 0) {
-                    atC = 1;
-                } else {
-                    atC = (playingAudio[i]->totalTime - ((double)playingAudio[i]->remainingCycles / sampleRate)) / playingAudio[i]->attack;
-                    atC = atC > 1 ? 1 : atC;
-                }
+        float r = 2, rInc = 0;
+        if (snd->release != 0) {
+            rInc = (float)(1 / (snd->release * sampleRate));
+            r = (float)((double)snd->remainingCycles * rInc);
+        }
 
-                if (playingAudio[i]->release == 0) {
-                    rlC = 1;
-                } else {
-                    rlC = playingAudio[i]->release - ((double)playingAudio[i]->remainingCycles / sampleRate);
-                    rlC = rlC > 0 ? 1 - rlC / playingAudio[i]->release : 1;
-                }
+        renderWave(voice, voiceBuffer, len);
+        mixEnvelope(out, voiceBuffer, len, snd->volume, a, aInc, r, rInc);
+
+        snd->remainingCycles -= len;
+        out += len;
+        n -= len;
+        clock += len;
+    }
+}
+
+// Lets go of whatever the voice was playing
+static void releaseSampleVoice(sampleVoice *v) {
+    if (v->data != NULL) {
+        SDL_AtomicAdd(&v->data->refs, -1);
+    }
+    if (v->stream != NULL) {
+        SDL_AtomicSet(&v->stream->released, 1);
+    }
+
+    v->data = NULL;
+    v->stream = NULL;
+}
+
+// Starts and stops sample voices as play and stop requests arrive. A play
+// takes a free voice, or the one started longest ago.
+static void applySampleCommands() {
+    unsigned int r = (unsigned int)SDL_AtomicGet(&sampleCommands.read);
+    unsigned int w = (unsigned int)SDL_AtomicGet(&sampleCommands.write);
+
+    for (; r != w; r++) {
+        sampleCommand *cmd = &sampleCommands.cmds[r & (COMMAND_SIZE - 1)];
 
-                double vol = playingAudio[i]->volume * atC * rlC;
-                
-                switch (i) {
-                case 0:
-                case 1:
-                    // Pulse Wave
-                    floatStream[z] += (float)((fmod(streamPhase[i], TAO) > PI/4 ? -1 : 1) * vol);
-                    streamPhase[i] += TAO * playingAudio[i]->frequency / sampleRate;
-                    break;
-                case 2:
-                    // Triangle Wave
-                    floatStream[z] += (float)((1 - 4 * fabs(fmod(streamPhase[i], 1) - 0.5)) * vol);
-                    streamPhase[i] += (double)playingAudio[i]->frequency / sampleRate;
-                    break;
-                case 3:
-                    // Sawtooth Wave
-                    floatStream[z] += (float)((2 * fmod(streamPhase[i] - 0.5, 1) - 1) * vol);
-                    streamPhase[i] += (double)playingAudio[i]->frequency / sampleRate;
-                    break;
-                case 4:
-                    // Noise (Wave?)
-                    delta = fmod((streamPhase[i] + 1), playingAudio[i]->frequency);
-                    if (streamPhase[i] > delta) {
-                        lstRnd = (float)((((float)rand() / (float)RAND_MAX) * 2 - 1) * vol);
-                    }
-                    streamPhase[i] = delta;
-                    
-                    floatStream[z] += lstRnd;
-
-                    break;
+        if (cmd->type == SAMPLE_STOP) {
+            for (int i = 0; i < SAMPLE_VOICES; i++) {
+                if (cmd->id == 0 || sampleVoices[i].id == cmd->id) {
+                    releaseSampleVoice(&sampleVoices[i]);
                 }
+            }
+            continue;
+        }
 
-                playingAudio[i]->remainingCycles--;
-                
-                playingAudio[i]->frequency += playingAudio[i]->frequencyShift;
+        sampleVoice *v = &sampleVoices[0];
+        for (int i = 0; i < SAMPLE_VOICES; i++) {
+            sampleVoice *c = &sampleVoices[i];
+            if (c->data == NULL && c->stream == NULL) {
+                v = c;
+                break;
+            }
+            if ((int)(c->started - v->started) < 0) {
+                v = c;
             }
         }
+        releaseSampleVoice(v);
+
+        int rate = cmd->data != NULL ? cmd->data->rate : cmd->stream->wav.rate;
+        v->id = cmd->id;
+        v->data = cmd->data;
+        v->stream = cmd->stream;
+        v->volume = cmd->volume;
+        v->pitch = cmd->pitch;
+        v->loop = cmd->loop;
+        v->startAt = cmd->startAt;
+        v->pos = 0;
+        v->step = (uint64_t)(cmd->pitch * rate / sampleRate * 4294967296.0);
+        v->started = sampleStarts++;
     }
+
+    SDL_AtomicSet(&sampleCommands.read, (int)r);
 }
 
-static int aud_stopChan(lua_State *L) {
-    int chan = luaL_checkint(L, 1) - 1;
-    if (chan < 0 || chan >= channelCount) {
-        lua_pushboolean(L, false);
-        return 1;
+// Resamples n frames of loaded sample data into out, linearly interpolated.
+// Returns false once a one shot sample has ended.
+static bool renderSampleData(sampleVoice *v, float *out, int n) {
+    const float *frames = v->data->frames;
+    uint32_t length = v->data->length;
+    uint64_t end = (uint64_t)length << 32;
+    uint64_t pos = v->pos;
+
+    for (int i = 0; i < n; i++) {
+        if (pos >= end) {
+            if (!v->loop || length == 0) {
+                memset(out + i, 0, (n - i) * sizeof(float));
+                return false;
+            }
+            pos %= end;
+        }
+
+        uint32_t idx = (uint32_t)(pos >> 32);
+        float frac = (float)(pos & 0xFFFFFFFF) * (1.0f / 4294967296.0f);
+        float a = frames[idx];
+        float b = idx + 1 < length ? frames[idx + 1] : (v->loop ? frames[0] : a);
+
+        out[i] = a + (b - a) * frac;
+        pos += v->step;
     }
 
-    if (!channelHasSnd[chan]) {
-        if (audioQueues[chan]->tail != NULL) {
-            playingAudio[chan] = popFromQueue(audioQueues[chan]);
-            channelHasSnd[chan] = true;
-        } else {
-            lua_pushboolean(L, false);
-            return 1;
+    v->pos = pos;
+    return true;
+}
+
+// The same for a stream, reading from its ring. Running dry before the decoder
+// catches up plays silence, returns false once the file is used up.
+static bool renderStream(sampleVoice *v, float *out, int n) {
+    pcmStream *s = v->stream;
+    // eof is published after the last write, so read it first
+    bool eof = SDL_AtomicGet(&s->eof) != 0;
+    unsigned int r = (unsigned int)SDL_AtomicGet(&s->read);
+    unsigned int w = (unsigned int)SDL_AtomicGet(&s->write);
+    uint64_t pos = v->pos;
+
+    int i = 0;
+    for (; i < n; i++) {
+        unsigned int avail = w - r;
+        if (avail == 0 || (avail == 1 && !eof)) {
+            if (!waitForStreams || eof) break;
+
+            SDL_Delay(1);
+            eof = SDL_AtomicGet(&s->eof) != 0;
+            w = (unsigned int)SDL_AtomicGet(&s->write);
+            i--;
+            continue;
         }
-    }
 
-    free(playingAudio[chan]);
+        float a = s->ring[r & (STREAM_SIZE - 1)];
+        float b = avail > 1 ? s->ring[(r + 1) & (STREAM_SIZE - 1)] : a;
+        float frac = (float)(pos & 0xFFFFFFFF) * (1.0f / 4294967296.0f);
+        out[i] = a + (b - a) * frac;
 
-    while (audioQueues[chan]->tail != NULL) {
-        playingAudio[chan] = popFromQueue(audioQueues[chan]);
-        free(playingAudio[chan]);
+        pos += v->step;
+        unsigned int whole = (unsigned int)(pos >> 32);
+        r += whole < avail ? whole : avail;
+        pos &= 0xFFFFFFFF;
     }
 
-    channelHasSnd[chan] = false;
+    memset(out + i, 0, (n - i) * sizeof(float));
+    v->pos = pos;
+    SDL_AtomicSet(&s->read, (int)r);
 
-    streamPhase[chan] = 0;
+    return !(eof && r == w);
+}
 
-    lua_pushboolean(L, true);
-    return 1;
+static void renderSamples(float *out, int n, uint64_t clock) {
+    for (int i = 0; i < SAMPLE_VOICES; i++) {
+        sampleVoice *v = &sampleVoices[i];
+        if (v->data == NULL && v->stream == NULL) continue;
+
+        int wait = 0;
+        if (v->startAt > clock) {
+            if (v->startAt - clock >= (uint64_t)n) continue;
+            wait = (int)(v->startAt - clock);
+        }
+
+        int len = n - wait;
+        bool playing = v->data != NULL ? renderSampleData(v, voiceBuffer, len) : renderStream(v, voiceBuffer, len);
+        mixEnvelope(out + wait, voiceBuffer, len, v->volume, 1, 0, 2, 0);
+
+        if (!playing) {
+            releaseSampleVoice(v);
+        }
+    }
 }
 
-static int aud_stopAll(lua_State *L) {
-    for (int i = 0; i < channelCount; i++) {
-        if (!channelHasSnd[i]) {
-            if (audioQueues[i]->tail != NULL) {
-                playingAudio[i] = popFromQueue(audioQueues[i]);
-                channelHasSnd[i] = true;
-            } else {
-                continue;
-            }
+// Mixes frames of audio into out, interleaved over chans channels
+static void mixFrames(float *floatStream, int frames, int chans) {
+    for (int i = 0; i < voiceCount; i++) {
+        applyFlush(i);
+    }
+    applySampleCommands();
+
+    // Voices render mono blocks, copied to every device channel
+    for (int start = 0; start < frames; start += MIX_BLOCK) {
+        int n = frames - start < MIX_BLOCK ? frames - start : MIX_BLOCK;
+
+        memset(mixBuffer, 0, n * sizeof(float));
+        for (int i = 0; i < voiceCount; i++) {
+            renderVoice(i, mixBuffer, n, mixClock);
         }
+        renderSamples(mixBuffer, n, mixClock);
+        mixClock += n;
 
-        free(playingAudio[i]);
+        float *dst = floatStream + start * chans;
+        for (int z = 0; z < n; z++) {
+            for (int cc = 0; cc < chans; cc++) {
+                dst[z * chans + cc] = mixBuffer[z];
+            }
+        }
+    }
 
-        while (audioQueues[i]->tail != NULL) {
-            playingAudio[i] = popFromQueue(audioQueues[i]);
-            free(playingAudio[i]);
+    // A voice whose note ran out this callback is done with everything popped
+    for (int i = 0; i < voiceCount; i++) {
+        if (!voices[i].active || voices[i].sound.remainingCycles == 0) {
+            SDL_AtomicSet(&noteRings[i].done, SDL_AtomicGet(&noteRings[i].read));
         }
+    }
+
+    SDL_AtomicSet(&publishedClock, (int)(uint32_t)mixClock);
+}
+
+static void audioCallback(void *userdata, uint8_t *byteStream, int len) {
+    (void)userdata;
+    mixFrames((float *)byteStream, len / (int)sizeof(float) / audDevChanCount, audDevChanCount);
+}
+
+// Mixes mono frames on this thread, taking the audio the device would have
+// played next. Samples come out as little endian floats.
+static void renderOffline(float *out, int frames) {
+    if (dev != 0) SDL_LockAudioDevice(dev);
 
-        channelHasSnd[i] = false;
+    waitForStreams = true;
+    mixFrames(out, frames, 1);
+    waitForStreams = false;
 
-        streamPhase[i] = 0;
+    if (dev != 0) SDL_UnlockAudioDevice(dev);
+
+    for (int i = 0; i < frames; i++) {
+        out[i] = SDL_SwapFloatLE(out[i]);
+    }
+}
+
+static inline void putLE32(uint8_t *out, uint32_t v) {
+    out[0] = (uint8_t)v;
+    out[1] = (uint8_t)(v >> 8);
+    out[2] = (uint8_t)(v >> 16);
+    out[3] = (uint8_t)(v >> 24);
+}
+
+// A mono 32 bit float WAV header for frames frames at the mixer's rate
+static bool writeWavHeader(FILE *f, uint32_t frames) {
+    uint8_t h[44];
+    memcpy(h, "RIFF", 4);
+    putLE32(h + 4, 36 + frames * 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    putLE32(h + 16, 16);
+    putLE32(h + 20, 3 | (1 << 16));  // Float format, one channel
+    putLE32(h + 24, (uint32_t)sampleRate);
+    putLE32(h + 28, (uint32_t)sampleRate * 4);
+    putLE32(h + 32, 4 | (32 << 16));  // Block align, bits per sample
+    memcpy(h + 36, "data", 4);
+    putLE32(h + 40, frames * 4);
+
+    return fwrite(h, 1, 44, f) == 44;
+}
+
+bool audioFileOpen(const char *path) {
+    audioFile = fopen(path, "wb");
+    if (audioFile == NULL) return false;
+
+    audioFileFrames = 0;
+    audioFileSwaps = 0;
+    return writeWavHeader(audioFile, 0);
+}
+
+void audioFileFrame() {
+    if (audioFile == NULL) return;
+
+    audioFileSwaps++;
+    uint32_t target = (uint32_t)(audioFileSwaps * sampleRate / 60);
+
+    while (audioFileFrames < target) {
+        int n = target - audioFileFrames < 4096 ? (int)(target - audioFileFrames) : 4096;
+        renderOffline(renderBuffer, n);
+        fwrite(renderBuffer, sizeof(float), n, audioFile);
+        audioFileFrames += n;
+    }
+}
+
+void audioFileClose() {
+    if (audioFile == NULL) return;
+
+    fseek(audioFile, 0, SEEK_SET);
+    writeWavHeader(audioFile, audioFileFrames);
+    fclose(audioFile);
+    audioFile = NULL;
+}
+
+// The mixer's clock from the Lua thread. Only the low 32 bits are published,
+// so this has to run at least once every 2^32 frames (a day at 48kHz) to
+// keep the high half, play and now both do.
+static uint64_t luaClock() {
+    static uint64_t clock = 0;
+    uint32_t low = (uint32_t)SDL_AtomicGet(&publishedClock);
+
+    if (low < (uint32_t)clock) {
+        clock += (uint64_t)1 << 32;
+    }
+    clock = (clock & ~(uint64_t)0xFFFFFFFF) | low;
+    return clock;
+}
+
+// Reads an at field, seconds on the clock, as the frame to start on
+static uint64_t toStartFrame(lua_State *L, int idx, const char *func) {
+    if (lua_isnil(L, idx)) return 0;
+
+    if (lua_type(L, idx) != LUA_TNUMBER) {
+        luaL_error(L, "bad argument 'at' to '%s' (number expected, got %s)", func, lua_typename(L, lua_type(L, idx)));
+        return 0;
     }
 
+    double at = lua_tonumber(L, idx) * sampleRate + 0.5;
+    return at > 0 ? (at < 1.8e19 ? (uint64_t)at : (uint64_t)1.8e19) : 0;
+}
+
+// Asks the audio thread to drop everything queued on the channel so far,
+// returns whether there was anything to drop
+static bool stopChannel(int chan) {
+    noteRing *ring = &noteRings[chan];
+    int w = SDL_AtomicGet(&ring->write);
+    bool busy = w != SDL_AtomicGet(&ring->done);
+
+    SDL_AtomicSet(&ring->flushTo, w);
+    playEnd[chan] = 0;
+    return busy;
+}
+
+static int aud_stopChan(lua_State *L) {
+    int chan = luaL_checkint(L, 1) - 1;
+    if (chan < 0 || chan >= voiceCount) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushboolean(L, stopChannel(chan));
+    return 1;
+}
+
+// Whether anything drains the sample commands, the device callback or the
+// --audio-file recorder. Without one a queued sample would hold its data, and
+// a stream its thread and file, forever.
+static bool hasConsumer() {
+    return dev != 0 || audioFile != NULL;
+}
+
+static bool pushSampleCommand(const sampleCommand *cmd) {
+    unsigned int w = (unsigned int)SDL_AtomicGet(&sampleCommands.write);
+    unsigned int r = (unsigned int)SDL_AtomicGet(&sampleCommands.read);
+    if (w - r >= (unsigned int)COMMAND_SIZE) return false;
+
+    sampleCommands.cmds[w & (COMMAND_SIZE - 1)] = *cmd;
+    SDL_AtomicSet(&sampleCommands.write, (int)(w + 1));
+    return true;
+}
+
+static int aud_stopAll(lua_State *L) {
+    for (int i = 0; i < voiceCount; i++) {
+        stopChannel(i);
+    }
+
+    sampleCommand cmd;
+    cmd.type = SAMPLE_STOP;
+    cmd.id = 0;
+    pushSampleCommand(&cmd);
+
     return 0;
 }
 
+// Picks the channel for a note that doesn't name one: the highest one that
+// is idle or will be by the time the note starts, otherwise the one whose
+// latest note was played longest ago, which is stopped
+static int allocChannel(uint64_t start) {
+    int oldest = voiceCount - 1;
+    for (int i = voiceCount - 1; i >= 0; i--) {
+        noteRing *ring = &noteRings[i];
+        if (SDL_AtomicGet(&ring->done) == SDL_AtomicGet(&ring->write) || playEnd[i] <= start) {
+            return i;
+        }
+        if ((int)(playStamp[i] - playStamp[oldest]) < 0) {
+            oldest = i;
+        }
+    }
+
+    stopChannel(oldest);
+    return oldest;
+}
+
 static int aud_play(lua_State *L) {
     int off = lua_gettop(L);
     if (off == 0) {
@@ -283,10 +877,13 @@ static int aud_play(lua_State *L) {
 
     lua_pushstring(L, "channel");
     lua_gettable(L, -1 - off);
-    int chan = (int)luaL_checkinteger(L, -1);
+    int chan = 0;
+    if (!lua_isnil(L, -1)) {
+        chan = (int)luaL_checkinteger(L, -1);
 
-    if (chan <= 0 || chan > channelCount) {
-        luaL_error(L, "Channel must be between 1 and %d", channelCount);
+        if (chan <= 0 || chan > voiceCount) {
+            luaL_error(L, "Channel must be between 1 and %d", voiceCount);
+        }
     }
 
     lua_pushstring(L, "volume");
@@ -341,36 +938,459 @@ static int aud_play(lua_State *L) {
         return 0;
     }
 
-    Sound* puls = (Sound*)malloc(sizeof(Sound));
-    if (chan == 5) {
-        puls->frequency = (110 - (12 * (log(pow(2, 1 / 12) * freq / 16.35) / log(2))));
-        puls->frequencyShift = ((110 - (12 * (log(pow(2, 1 / 12) * (freq + freqShft) / 16.35) / log(2)))) - puls->frequency) / (sampleRate * time);
+    lua_pushstring(L, "waveform");
+    lua_gettable(L, -8 - off);
+    int waveform = chan > 0 && chan <= fixedChannels ? channelWaveforms[chan - 1] : WAVE_PULSE;
+    if (!lua_isnil(L, -1)) {
+        const char *name = lua_tostring(L, -1);
+        int i = 0;
+        while (name != NULL && waveformNames[i] != NULL && strcmp(name, waveformNames[i]) != 0) i++;
+
+        if (name == NULL || waveformNames[i] == NULL) {
+            luaL_error(L, "bad argument 'waveform' to 'play' (expected pulse, triangle, saw, noise or sine)");
+            return 0;
+        }
+        waveform = i;
+    }
+
+    // Fraction of the cycle a pulse stays high, the original pulse channels used 1/8
+    lua_pushstring(L, "duty");
+    lua_gettable(L, -9 - off);
+    double duty = 0.125;
+    if (!lua_isnil(L, -1)) {
+        duty = luaL_checknumber(L, -1);
+        duty = duty < 0.01 ? 0.01 : (duty > 0.99 ? 0.99 : duty);
+    }
+
+    lua_pushstring(L, "at");
+    lua_gettable(L, -10 - off);
+    uint64_t startAt = toStartFrame(L, -1, "play");
+
+    Sound puls;
+    if (waveform == WAVE_NOISE) {
+        puls.frequency = (110 - (12 * (log(pow(2, 1 / 12) * freq / 16.35) / log(2))));
+        puls.frequencyShift = ((110 - (12 * (log(pow(2, 1 / 12) * (freq + freqShft) / 16.35) / log(2)))) - puls.frequency) / (sampleRate * time);
     } else {
-        puls->frequency = freq;
-        puls->frequencyShift = (double)freqShft / (sampleRate * time);
+        puls.frequency = freq;
+        puls.frequencyShift = (double)freqShft / (sampleRate * time);
     }
     
-    puls->volume = vol < 0 ? 0 : (vol > 1 ? 1 : (float)vol);
-    puls->totalTime = time;
-    puls->attack = atK;
-    puls->release = rls;
-    puls->remainingCycles = (unsigned long long)(time * sampleRate);
-    pushToQueue(audioQueues[chan - 1], puls);
+    puls.volume = vol < 0 ? 0 : (vol > 1 ? 1 : (float)vol);
+    puls.totalTime = time;
+    puls.attack = atK;
+    puls.release = rls;
+    puls.remainingCycles = (unsigned long long)(time * sampleRate);
+    puls.waveform = waveform;
+    puls.duty = (float)duty;
+    puls.startAt = startAt;
+
+    // Roughly when the note will start, after anything already queued on
+    // its channel
+    uint64_t now = luaClock();
+    uint64_t start = startAt > now ? startAt : now;
+
+    if (chan == 0) {
+        chan = allocChannel(start) + 1;
+    }
+
+    // Full rings drop the note rather than block or grow, otherwise the
+    // channel it went to is returned
+    if (!ringPush(&noteRings[chan - 1], &puls)) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    if (playEnd[chan - 1] > start) {
+        start = playEnd[chan - 1];
+    }
+    playEnd[chan - 1] = start + puls.remainingCycles;
+
+    playStamp[chan - 1] = ++playCounter;
+    lua_pushinteger(L, chan);
+    return 1;
+}
+
+// Frees collected samples that the voices have since let go of
+static void sweepDeadSamples() {
+    pcmData **link = &deadSamples;
+    while (*link != NULL) {
+        pcmData *data = *link;
+        if (SDL_AtomicGet(&data->refs) == 0) {
+            *link = data->nextDead;
+            free(data->frames);
+            free(data);
+        } else {
+            link = &data->nextDead;
+        }
+    }
+}
+
+static sampleType *checkSample(lua_State *L) {
+    void *ud = luaL_checkudata(L, 1, "Riko4.Sample");
+    luaL_argcheck(L, ud != NULL, 1, "`Sample` expected");
+    return (sampleType *)ud;
+}
+
+// Returns the Sample at idx, or NULL if it isn't one
+static sampleType *toSample(lua_State *L, int idx) {
+    void *ud = lua_touserdata(L, idx);
+    if (ud == NULL || !lua_getmetatable(L, idx)) return NULL;
+
+    luaL_getmetatable(L, "Riko4.Sample");
+    bool isSample = lua_rawequal(L, -1, -2) != 0;
+    lua_pop(L, 2);
+
+    return isSample ? (sampleType *)ud : NULL;
+}
 
+// Reads the volume, pitch, loop and at fields shared by playSample and stream
+static void sampleOptions(lua_State *L, int idx, const char *func, sampleCommand *cmd) {
+    lua_getfield(L, idx, "volume");
+    if (!lua_isnil(L, -1)) {
+        double vol = lua_tonumber(L, -1);
+        cmd->volume = vol < 0 ? 0 : (vol > 1 ? 1 : (float)vol);
+    }
+
+    lua_getfield(L, idx, "pitch");
+    if (!lua_isnil(L, -1)) {
+        double pitch = lua_tonumber(L, -1);
+        if (!(pitch > 0)) {
+            luaL_error(L, "bad argument 'pitch' to '%s' (number must be greater than 0)", func);
+        }
+        cmd->pitch = pitch > 1024 ? 1024 : pitch;
+    }
+
+    lua_getfield(L, idx, "loop");
+    cmd->loop = lua_toboolean(L, -1) != 0;
+
+    lua_getfield(L, idx, "at");
+    cmd->startAt = toStartFrame(L, -1, func);
+
+    lua_pop(L, 4);
+}
+
+// speaker.loadSample(path) decodes a whole WAV file from the fs sandbox
+static int aud_loadSample(lua_State *L) {
+    char filePath[MAX_PATH + 1];
+    fsResolvePath(L, luaL_checkstring(L, 1), filePath);
+
+    sweepDeadSamples();
+
+    sampleType *sample = (sampleType *)lua_newuserdata(L, sizeof(sampleType));
+    sample->data = NULL;
+    luaL_getmetatable(L, "Riko4.Sample");
+    lua_setmetatable(L, -2);
+
+    FILE *f = fopen(filePath, "rb");
+    if (f == NULL) {
+        return luaL_error(L, "No such file");
+    }
+
+    wavReader wav;
+    const char *err = wavOpen(&wav, f);
+    if (err == NULL && wav.frames > (1u << 28)) {
+        err = "sample too long, use speaker.stream";
+    }
+    if (err != NULL) {
+        fclose(f);
+        return luaL_error(L, "%s", err);
+    }
+
+    pcmData *data = (pcmData *)malloc(sizeof(pcmData));
+    float *frames = (float *)malloc((size_t)(wav.frames > 0 ? wav.frames : 1) * sizeof(float));
+    if (data == NULL || frames == NULL) {
+        free(data);
+        free(frames);
+        fclose(f);
+        return luaL_error(L, "not enough memory for sample");
+    }
+
+    data->length = wavRead(&wav, frames, wav.frames);
+    data->frames = frames;
+    data->rate = wav.rate;
+    data->nextDead = NULL;
+    SDL_AtomicSet(&data->refs, 1);
+    fclose(f);
+
+    sample->data = data;
+    return 1;
+}
+
+static int sampleGC(lua_State *L) {
+    sampleType *sample = checkSample(L);
+    pcmData *data = sample->data;
+    sample->data = NULL;
+
+    if (data != NULL) {
+        if (SDL_AtomicDecRef(&data->refs)) {
+            free(data->frames);
+            free(data);
+        } else {
+            data->nextDead = deadSamples;
+            deadSamples = data;
+        }
+    }
+
+    sweepDeadSamples();
     return 0;
 }
 
+// sample:getLength() in seconds at its own rate
+static int sampleGetLength(lua_State *L) {
+    sampleType *sample = checkSample(L);
+    lua_pushnumber(L, sample->data != NULL ? (double)sample->data->length / sample->data->rate : 0);
+    return 1;
+}
+
+// speaker.playSample{sample, volume, pitch, loop} returns an id for stopSample,
+// or false if there is no audio output or too many requests are waiting on
+// the audio thread
+static int aud_playSample(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "sample");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_rawgeti(L, 1, 1);
+    }
+    sampleType *sample = toSample(L, -1);
+    lua_pop(L, 1);
+
+    if (sample == NULL || sample->data == NULL) {
+        return luaL_error(L, "bad argument 'sample' to 'playSample' (Sample expected)");
+    }
+
+    sampleCommand cmd;
+    cmd.type = SAMPLE_PLAY;
+    cmd.data = sample->data;
+    cmd.stream = NULL;
+    cmd.volume = 1;
+    cmd.pitch = 1;
+    sampleOptions(L, 1, "playSample", &cmd);
+
+    sweepDeadSamples();
+
+    if (!hasConsumer()) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    cmd.id = ++lastSampleId;
+    SDL_AtomicIncRef(&sample->data->refs);
+    if (!pushSampleCommand(&cmd)) {
+        SDL_AtomicAdd(&sample->data->refs, -1);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushinteger(L, cmd.id);
+    return 1;
+}
+
+// Decodes up to max frames into the free part of the ring, going back to the
+// start of the file when looping. Returns false once there is nothing left.
+static bool fillStream(pcmStream *s, uint32_t max) {
+    unsigned int w = (unsigned int)SDL_AtomicGet(&s->write);
+    unsigned int r = (unsigned int)SDL_AtomicGet(&s->read);
+
+    uint32_t space = STREAM_SIZE - (w - r);
+    if (space > max) space = max;
+
+    while (space > 0) {
+        uint32_t idx = w & (STREAM_SIZE - 1);
+        uint32_t run = STREAM_SIZE - idx < space ? STREAM_SIZE - idx : space;
+
+        uint32_t got = wavRead(&s->wav, s->ring + idx, run);
+        w += got;
+        space -= got;
+        SDL_AtomicSet(&s->write, (int)w);
+
+        if (got < run && (!s->loop || s->wav.frames == 0 || !wavRewind(&s->wav))) {
+            SDL_AtomicSet(&s->eof, 1);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Keeps a stream's ring topped up until the mixer is done with it
+static int streamThread(void *ptr) {
+    pcmStream *s = (pcmStream *)ptr;
+    bool more = true;
+
+    while (!SDL_AtomicGet(&s->released)) {
+        unsigned int before = (unsigned int)SDL_AtomicGet(&s->write);
+        if (more) {
+            more = fillStream(s, 4096);
+        }
+
+        if (!more || (unsigned int)SDL_AtomicGet(&s->write) == before) {
+            SDL_Delay(5);
+        }
+    }
+
+    fclose(s->wav.file);
+    free(s);
+    return 0;
+}
+
+// speaker.stream(path[, {volume, pitch, loop}]) plays a WAV file from the fs
+// sandbox without loading all of it, returns an id like playSample
+static int aud_stream(lua_State *L) {
+    char filePath[MAX_PATH + 1];
+    fsResolvePath(L, luaL_checkstring(L, 1), filePath);
+
+    sampleCommand cmd;
+    cmd.type = SAMPLE_PLAY;
+    cmd.data = NULL;
+    cmd.volume = 1;
+    cmd.pitch = 1;
+    cmd.loop = false;
+    cmd.startAt = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        sampleOptions(L, 2, "stream", &cmd);
+    }
+
+    if (!hasConsumer()) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    FILE *f = fopen(filePath, "rb");
+    if (f == NULL) {
+        return luaL_error(L, "No such file");
+    }
+
+    pcmStream *s = (pcmStream *)malloc(sizeof(pcmStream));
+    if (s == NULL) {
+        fclose(f);
+        return luaL_error(L, "not enough memory for stream");
+    }
+
+    const char *err = wavOpen(&s->wav, f);
+    if (err != NULL) {
+        fclose(f);
+        free(s);
+        return luaL_error(L, "%s", err);
+    }
+
+    SDL_AtomicSet(&s->read, 0);
+    SDL_AtomicSet(&s->write, 0);
+    SDL_AtomicSet(&s->eof, 0);
+    SDL_AtomicSet(&s->released, 0);
+    s->loop = cmd.loop;
+
+    // Starts with enough decoded that the first callbacks never wait on the thread
+    fillStream(s, STREAM_PREFILL);
+
+    SDL_Thread *thread = SDL_CreateThread(streamThread, "riko4 stream", s);
+    if (thread == NULL) {
+        fclose(f);
+        free(s);
+        return luaL_error(L, "unable to start stream: %s", SDL_GetError());
+    }
+    SDL_DetachThread(thread);
+
+    cmd.stream = s;
+    cmd.id = ++lastSampleId;
+    if (!pushSampleCommand(&cmd)) {
+        SDL_AtomicSet(&s->released, 1);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushinteger(L, cmd.id);
+    return 1;
+}
+
+// speaker.render(seconds[, path]) mixes the next seconds of audio right away,
+// returning them as a string of little endian 32 bit floats, or writing them
+// to a WAV file in the fs sandbox
+static int aud_render(lua_State *L) {
+    double seconds = luaL_checknumber(L, 1);
+    if (!(seconds >= 0 && seconds <= 3600)) {
+        return luaL_error(L, "bad argument #1 to 'render' (seconds must be between 0 and 3600)");
+    }
+    uint32_t frames = (uint32_t)(seconds * sampleRate + 0.5);
+
+    if (lua_isnoneornil(L, 2)) {
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+
+        while (frames > 0) {
+            int n = frames < 4096 ? (int)frames : 4096;
+            renderOffline(renderBuffer, n);
+            luaL_addlstring(&b, (const char *)renderBuffer, n * sizeof(float));
+            frames -= n;
+        }
+
+        luaL_pushresult(&b);
+        return 1;
+    }
+
+    char filePath[MAX_PATH + 1];
+    fsResolvePath(L, luaL_checkstring(L, 2), filePath);
+
+    FILE *f = fopen(filePath, "wb");
+    if (f == NULL) {
+        return luaL_error(L, "Unable to open file for writing");
+    }
+
+    bool ok = writeWavHeader(f, frames);
+    while (ok && frames > 0) {
+        int n = frames < 4096 ? (int)frames : 4096;
+        renderOffline(renderBuffer, n);
+        ok = fwrite(renderBuffer, sizeof(float), n, f) == (size_t)n;
+        frames -= n;
+    }
+    fclose(f);
+
+    lua_pushboolean(L, ok);
+    return 1;
+}
+
+// speaker.now() is the time in seconds on the clock at and render work on,
+// how much audio has been mixed so far
+static int aud_now(lua_State *L) {
+    lua_pushnumber(L, (double)luaClock() / sampleRate);
+    return 1;
+}
+
+// speaker.stopSample(id) stops a playSample or stream
+static int aud_stopSample(lua_State *L) {
+    sampleCommand cmd;
+    cmd.type = SAMPLE_STOP;
+    cmd.id = luaL_checkint(L, 1);
+
+    lua_pushboolean(L, cmd.id > 0 && hasConsumer() && pushSampleCommand(&cmd));
+    return 1;
+}
+
 static const luaL_Reg audLib[] = {
     { "play", aud_play },
     { "stopChannel", aud_stopChan },
     { "stopAll", aud_stopAll },
+    { "loadSample", aud_loadSample },
+    { "playSample", aud_playSample },
+    { "stream", aud_stream },
+    { "stopSample", aud_stopSample },
+    { "render", aud_render },
+    { "now", aud_now },
+    { NULL, NULL }
+};
+
+static const luaL_Reg sampleLib_m[] = {
+    { "getLength", sampleGetLength },
     { NULL, NULL }
 };
 
 LUALIB_API int luaopen_aud(lua_State *L) {
-    for (int i = 0; i < channelCount; i++) {
-        audioQueues[i] = constructQueue();
-        streamPhase[i] = 0;
+    buildWavetables();
+    voiceCount = audVoices < fixedChannels ? fixedChannels : (audVoices > MAX_VOICES ? MAX_VOICES : audVoices);
+    for (int i = 0; i < voiceCount; i++) {
+        voices[i].noiseState = 0x9E3779B9u + i;
     }
 
     if (audEnabled) {
@@ -395,23 +1415,39 @@ LUALIB_API int luaopen_aud(lua_State *L) {
 
             if (have.format != want.format) { /* we can't let this one thing change. */
                 SDL_Log("Unable to open Float32 audio.");
+
+                // Never unpaused, so nothing would mix for it
+                SDL_CloseAudioDevice(dev);
+                dev = 0;
             } else {
                 SDL_PauseAudioDevice(dev, 0); /* start audio playing. */
             }
         }
     }
 
+    luaL_newmetatable(L, "Riko4.Sample");
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, sampleGC);
+    lua_settable(L, -3);
+
+    luaL_openlib(L, NULL, sampleLib_m, 0);
+    lua_pop(L, 1);
+
     luaL_openlib(L, RIKO_AUD_NAME, audLib, 0);
+
+    lua_pushinteger(L, voiceCount);
+    lua_setfield(L, -2, "voices");
     return 1;
 }
 
 void closeAudio() {
+    audioFileClose();
+
     if (dev != 0) {
         SDL_CloseAudioDevice(dev);
     }
-
-    for (int i = 0; i < channelCount; i++) {
-        falloutQueue(audioQueues[i]);
-        free(audioQueues[i]);
-    }
 }
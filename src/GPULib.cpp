@@ -11,17 +11,22 @@
 #include "rikoConsts.h"
 
 #include "rikoGPU.h"
+#include "rikoImage.h"
+#include "rikoAudio.h"
 #include "shader.h"
+#include "headless.h"
+#include "raster.h"
 
 #include "luaIncludes.h"
 #include <SDL2/SDL.h>
 #include "SDL_gpu/SDL_gpu.h"
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern GPU_Target *renderer;
-extern GPU_Target *bufferTarget;
 extern GPU_Image *buffer;
 extern int pixelSize;
 extern int afPixscale;
@@ -50,6 +55,35 @@ int paletteNum = 0;
 int drawOffX = 0;
 int drawOffY = 0;
 
+// The screen is kept CPU side as one palette index per pixel, every gpu.*
+// primitive writes into it and gpu.swap uploads it to the GPU in one go.
+// The indices are resolved against the palette uniform in the screen shader.
+uint8_t screenBuffer[SCRN_WIDTH * SCRN_HEIGHT];
+static int uploadedPaletteNum = -1;
+
+// Where drawing goes, the screen unless gpu.setTarget picked an Image. The
+// target Image is kept referenced, and the screen clip rect kept aside, until
+// drawing switches back to the screen.
+drawTarget currentTarget = { screenBuffer, SCRN_WIDTH, SCRN_HEIGHT, SCRN_WIDTH };
+static int currentTargetRef = LUA_NOREF;
+static int screenClip[4] = { 0, 0, SCRN_WIDTH, SCRN_HEIGHT };
+
+// What the GPU texture currently holds, and the bounding box of everything
+// written to screenBuffer since the last swap (empty when x1 <= x0). Swap only
+// diffs and uploads inside that box, and skips presenting when nothing changed.
+static uint8_t uploadedScreen[SCRN_WIDTH * SCRN_HEIGHT];
+static int dirtyX0 = 0;
+static int dirtyY0 = 0;
+static int dirtyX1 = SCRN_WIDTH;
+static int dirtyY1 = SCRN_HEIGHT;
+static bool textureValid = false;
+bool forcePresent = true;
+
+int clipX = 0;
+int clipY = 0;
+int clipW = SCRN_WIDTH;
+int clipH = SCRN_HEIGHT;
+
 #define off(o, t) o - drawOffX, t - drawOffY
 
 static int getColor(lua_State *L, int arg) {
@@ -57,15 +91,62 @@ static int getColor(lua_State *L, int arg) {
     return color < 0 ? 0 : (color > 15 ? 15 : color);
 }
 
+// Grows the dirty box by an already clipped rect, x1/y1 exclusive. Writes to
+// an Image target leave the screen untouched and are ignored.
+void screenMarkDirty(int x0, int y0, int x1, int y1) {
+    if (x1 <= x0 || y1 <= y0 || currentTarget.pixels != screenBuffer) return;
+
+    if (dirtyX1 <= dirtyX0) {
+        dirtyX0 = x0;
+        dirtyY0 = y0;
+        dirtyX1 = x1;
+        dirtyY1 = y1;
+        return;
+    }
+
+    if (x0 < dirtyX0) dirtyX0 = x0;
+    if (y0 < dirtyY0) dirtyY0 = y0;
+    if (x1 > dirtyX1) dirtyX1 = x1;
+    if (y1 > dirtyY1) dirtyY1 = y1;
+}
+
+static inline void screenDrawPixel(int x, int y, uint8_t c) {
+    if (x >= clipX && y >= clipY && x < clipX + clipW && y < clipY + clipH) {
+        currentTarget.pixels[y * currentTarget.pitch + x] = c;
+        screenMarkDirty(x, y, x + 1, y + 1);
+    }
+}
+
+static void screenFillRect(int x, int y, int w, int h, uint8_t c) {
+    if (w < 0) {
+        x += w;
+        w = -w;
+    }
+    if (h < 0) {
+        y += h;
+        h = -h;
+    }
+
+    int x0 = x < clipX ? clipX : x;
+    int y0 = y < clipY ? clipY : y;
+    int x1 = x + w > clipX + clipW ? clipX + clipW : x + w;
+    int y1 = y + h > clipY + clipH ? clipY + clipH : y + h;
+
+    if (x1 <= x0 || y1 <= y0) return;
+
+    for (int yp = y0; yp < y1; yp++) {
+        memset(currentTarget.pixels + yp * currentTarget.pitch + x0, c, x1 - x0);
+    }
+    screenMarkDirty(x0, y0, x1, y1);
+}
+
 static int gpu_draw_pixel(lua_State *L) {
     int x = luaL_checkint(L, 1);
     int y = luaL_checkint(L, 2);
 
     int color = getColor(L, 3);
 
-    SDL_Color colorS = {palette[(int)color][0], palette[(int)color][1], palette[(int)color][2], 255};
-
-    GPU_RectangleFilled(bufferTarget, off(x, y), off(x + 1, y + 1), colorS);
+    screenDrawPixel(off(x, y), (uint8_t)color);
 
     return 0;
 }
@@ -76,25 +157,310 @@ static int gpu_draw_rectangle(lua_State *L) {
     int x = luaL_checkint(L, 1);
     int y = luaL_checkint(L, 2);
 
-    GPU_Rect rect = {
-        off(x, y),
-        (luaL_checkint(L, 3)),
-        (luaL_checkint(L, 4))
-    };
+    screenFillRect(off(x, y), luaL_checkint(L, 3), luaL_checkint(L, 4), (uint8_t)color);
+
+    return 0;
+}
+
+// Reads entry i of a batch table, rejecting non-numbers like luaL_checkint
+int batchValue(lua_State *L, int tbl, int i) {
+    lua_rawgeti(L, tbl, i);
+    if (!lua_isnumber(L, -1)) {
+        luaL_argerror(L, tbl, lua_pushfstring(L, "number expected at index %d, got %s", i, luaL_typename(L, -1)));
+        return 0;
+    }
+    int v = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
+// Draws a flat list of rectangles {x, y, w, h, color, ...} in one call, so
+// scanline based shapes don't pay a Lua -> C transition per span
+static int gpu_draw_rectangles(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int count = lua_isnoneornil(L, 2) ? (int)lua_objlen(L, 1) / 5 : luaL_checkint(L, 2);
+
+    for (int i = 0; i < count; i++) {
+        int base = i * 5;
+        int x = batchValue(L, 1, base + 1);
+        int y = batchValue(L, 1, base + 2);
+        int w = batchValue(L, 1, base + 3);
+        int h = batchValue(L, 1, base + 4);
+        int color = batchValue(L, 1, base + 5) - 1;
+        color = color < 0 ? 0 : (color > 15 ? 15 : color);
+
+        screenFillRect(off(x, y), w, h, (uint8_t)color);
+    }
+
+    return 0;
+}
+
+// Same as drawRectangles but for a flat list of pixels {x, y, color, ...}
+static int gpu_draw_pixels(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int count = lua_isnoneornil(L, 2) ? (int)lua_objlen(L, 1) / 3 : luaL_checkint(L, 2);
+
+    for (int i = 0; i < count; i++) {
+        int base = i * 3;
+        int x = batchValue(L, 1, base + 1);
+        int y = batchValue(L, 1, base + 2);
+        int color = batchValue(L, 1, base + 3) - 1;
+        color = color < 0 ? 0 : (color > 15 ? 15 : color);
+
+        screenDrawPixel(off(x, y), (uint8_t)color);
+    }
+
+    return 0;
+}
+
+static void screenSpan(void *ctx, int x, int y, int w, int h) {
+    screenFillRect(off(x, y), w, h, *(uint8_t *)ctx);
+}
+
+// Shapes are rasterized in untranslated coordinates, so the rows they can
+// reach are the clip rect shifted back by the translation
+static rasterTarget screenTarget(uint8_t *color) {
+    rasterTarget t;
+    t.span = screenSpan;
+    t.ctx = color;
+    t.top = clipY + drawOffY;
+    t.bottom = clipY + clipH + drawOffY;
+    return t;
+}
+
+static double *polyBuffer = NULL;
+static int polyCapacity = 0;
+
+// Reads a list of {x, y} points into a buffer reused between calls
+const double *checkPolygon(lua_State *L, int arg, int *n) {
+    luaL_checktype(L, arg, LUA_TTABLE);
+    int count = (int)lua_objlen(L, arg);
+
+    if (count > polyCapacity) {
+        double *grown = (double *)realloc(polyBuffer, count * 2 * sizeof(double));
+        if (grown == NULL) {
+            luaL_error(L, "Unable to allocate a %d point polygon", count);
+            return NULL;
+        }
+        polyBuffer = grown;
+        polyCapacity = count;
+    }
+
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L, arg, i + 1);
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "bad polygon point %d (table expected, got %s)", i + 1, luaL_typename(L, -1));
+            return NULL;
+        }
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        polyBuffer[i * 2] = lua_tonumber(L, -2);
+        polyBuffer[i * 2 + 1] = lua_tonumber(L, -1);
+        lua_pop(L, 3);
+    }
+
+    *n = count;
+    return polyBuffer;
+}
+
+static int gpu_draw_line(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 5);
+    rasterTarget t = screenTarget(&color);
 
-    SDL_Color colorS = { palette[(int)color][0], palette[(int)color][1], palette[(int)color][2], 255 };
-    GPU_RectangleFilled2(bufferTarget, rect, colorS);
+    rasterLine(&t, luaL_checknumber(L, 1), luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
 
     return 0;
 }
 
+static int gpu_draw_circle(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 4);
+    rasterTarget t = screenTarget(&color);
+
+    rasterCircle(&t, luaL_checknumber(L, 1), luaL_checknumber(L, 2), luaL_checknumber(L, 3));
+
+    return 0;
+}
+
+static int gpu_fill_circle(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 4);
+    rasterTarget t = screenTarget(&color);
+
+    rasterFillCircle(&t, luaL_checknumber(L, 1), luaL_checknumber(L, 2), luaL_checknumber(L, 3));
+
+    return 0;
+}
+
+static int gpu_draw_ellipse(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 5);
+    rasterTarget t = screenTarget(&color);
+
+    rasterEllipse(&t, luaL_checknumber(L, 1), luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+
+    return 0;
+}
+
+static int gpu_fill_ellipse(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 5);
+    rasterTarget t = screenTarget(&color);
+
+    rasterFillEllipse(&t, luaL_checknumber(L, 1), luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+
+    return 0;
+}
+
+static int gpu_fill_polygon(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 2);
+    rasterTarget t = screenTarget(&color);
+
+    int n;
+    const double *xy = checkPolygon(L, 1, &n);
+    rasterFillPolygon(&t, xy, n);
+
+    return 0;
+}
+
+static int gpu_fill_triangle(lua_State *L) {
+    uint8_t color = (uint8_t)getColor(L, 7);
+    rasterTarget t = screenTarget(&color);
+
+    double xy[6];
+    for (int i = 0; i < 6; i++) {
+        xy[i] = luaL_checknumber(L, i + 1);
+    }
+    rasterFillPolygon(&t, xy, 3);
+
+    return 0;
+}
+
+// Turns FFI cdata into a uint8_t * with ffi.cast, which also works on arrays
+// and structs, plus ffi.sizeof of the cdata. Numbers give nothing, so they
+// are never taken for addresses.
+static const char *cdataPointerSrc =
+    "local ffi = ...\n"
+    "local cast, sizeof, ct = ffi.cast, ffi.sizeof, ffi.typeof('uint8_t *')\n"
+    "return function(v)\n"
+    "  if tonumber(v) ~= nil then return nil end\n"
+    "  local ok, p = pcall(cast, ct, v)\n"
+    "  if ok then return p, sizeof(v) end\n"
+    "end\n";
+
+static int cdataPointerRef = LUA_NOREF;
+
+// Resolves cdata at arg to the bytes it holds or points to. An array or
+// struct is its own buffer, so its size is returned in size; a pointer's
+// size is unknown and left as (size_t)-1.
+static const uint8_t *cdataBytes(lua_State *L, int arg, size_t *size) {
+    if (cdataPointerRef == LUA_NOREF) {
+        lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+        lua_getfield(L, -1, "ffi");
+        lua_remove(L, -2);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return NULL;
+        }
+        if (luaL_loadstring(L, cdataPointerSrc) != 0) {
+            lua_pop(L, 2);
+            return NULL;
+        }
+        lua_insert(L, -2);
+        lua_call(L, 1, 1);
+        cdataPointerRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cdataPointerRef);
+    lua_pushvalue(L, arg);
+    lua_call(L, 1, 2);
+
+    const uint8_t *bytes = NULL;
+    if (lua_type(L, -2) == LUA_TCDATA) {
+        bytes = *(const uint8_t * const *)lua_topointer(L, -2);
+        *size = bytes == (const uint8_t *)lua_topointer(L, arg) ? (size_t)lua_tointeger(L, -1) : (size_t)-1;
+    }
+    lua_pop(L, 2);
+
+    return bytes;
+}
+
+// For error messages, lua_pushfstring only formats ints
+static inline int clampInt(size_t n) {
+    return n > (size_t)INT_MAX ? INT_MAX : (int)n;
+}
+
+// Resolves a string of pixel bytes, a lightuserdata or LuaJIT FFI cdata (a
+// pointer such as ffi.cast("uint8_t *", buf), or an array from
+// ffi.new("uint8_t[?]", n)) to its bytes. Strings and arrays must hold h rows
+// of stride bytes (the last only w), and stride, the argument after arg, can't
+// be less than w. Returns NULL when the argument is none of these, so callers
+// can fall back to the table form.
+const uint8_t *checkPixelBytes(lua_State *L, int arg, int w, int h, int stride) {
+    int type = lua_type(L, arg);
+    if (type != LUA_TSTRING && type != LUA_TLIGHTUSERDATA && type != LUA_TCDATA) {
+        return NULL;
+    }
+
+    luaL_argcheck(L, stride >= 0 && stride >= w, arg + 1, "stride must be at least the width");
+    size_t need = w > 0 && h > 0 ? (size_t)(h - 1) * (size_t)stride + (size_t)w : 0;
+
+    switch (type) {
+        case LUA_TSTRING: {
+            size_t len;
+            const char *str = lua_tolstring(L, arg, &len);
+            if (len < need) {
+                luaL_error(L, "blitPixels expected %d bytes, got %d", clampInt(need), clampInt(len));
+                return NULL;
+            }
+            return (const uint8_t *)str;
+        }
+        case LUA_TLIGHTUSERDATA:
+            return (const uint8_t *)lua_touserdata(L, arg);
+        default: {
+            size_t size;
+            const uint8_t *bytes = cdataBytes(L, arg, &size);
+            luaL_argcheck(L, bytes != NULL, arg, "pixel buffer expected");
+            if (size != (size_t)-1 && size < need) {
+                luaL_error(L, "pixel buffer holds %d bytes, needs %d", clampInt(size), clampInt(need));
+                return NULL;
+            }
+            return bytes;
+        }
+    }
+}
+
 static int gpu_blit_pixels(lua_State *L) {
     int x = luaL_checkint(L, 1);
     int y = luaL_checkint(L, 2);
     int w = luaL_checkint(L, 3);
     int h = luaL_checkint(L, 4);
+    int stride = luaL_optint(L, 6, w);
+
+    const uint8_t *bytes = checkPixelBytes(L, 5, w, h, stride);
+    if (bytes != NULL) {
+        x -= drawOffX;
+        y -= drawOffY;
+
+        int x0 = x < clipX ? clipX - x : 0;
+        int y0 = y < clipY ? clipY - y : 0;
+        int x1 = x + w > clipX + clipW ? clipX + clipW - x : w;
+        int y1 = y + h > clipY + clipH ? clipY + clipH - y : h;
+
+        for (int yp = y0; yp < y1; yp++) {
+            const uint8_t *src = bytes + (size_t)yp * stride;
+            uint8_t *dst = currentTarget.pixels + (y + yp) * currentTarget.pitch + x;
+            for (int xp = x0; xp < x1; xp++) {
+                int color = src[xp];
+                if (color == 0) continue;
+
+                dst[xp] = (uint8_t)(color > 16 ? 15 : color - 1);
+            }
+        }
+        screenMarkDirty(x + x0, y + y0, x + x1, y + y1);
 
-    unsigned long long amt = lua_objlen(L, -1);
+        return 0;
+    }
+
+    luaL_checktype(L, 5, LUA_TTABLE);
+
+    unsigned long long amt = lua_objlen(L, 5);
     int len = (int)w*(int)h;
     if (amt < len) {
         luaL_error(L, "blitPixels expected %d pixels, got %d", len, amt);
@@ -102,14 +468,14 @@ static int gpu_blit_pixels(lua_State *L) {
     }
 
     for (int i = 1; i <= len; i++) {
-        lua_pushnumber(L, i);
-        lua_gettable(L, -2);
+        lua_rawgeti(L, 5, i);
         if (!lua_isnumber(L, -1)) {
             luaL_error(L, "Index %d is non-numeric", i);
         }
         int color = (int)lua_tointeger(L, -1) - 1;
+        lua_pop(L, 1);
+
         if (color == -1) {
-            lua_pop(L, 1);
             continue;
         }
 
@@ -117,25 +483,166 @@ static int gpu_blit_pixels(lua_State *L) {
 
         int xp = (i - 1) % (int) w;
         int yp = (int)((i - 1) / (int) w);
-        
-        GPU_Rect rect = {
-            off(x + xp,
-                y + yp),
-            1, 1
-        };
 
-        SDL_Color colorS = { palette[(int)color][0], palette[(int)color][1], palette[(int)color][2], 255 };
-        GPU_RectangleFilled2(bufferTarget, rect, colorS);
+        screenDrawPixel(off(x + xp, y + yp), (uint8_t)color);
+    }
+
+    return 0;
+}
 
-        lua_pop(L, 1);
+fontType *currentFont = NULL;
+static int currentFontRef = LUA_NOREF;
+
+static fontType *checkFont(lua_State *L, int arg) {
+    void *ud = luaL_checkudata(L, arg, "Riko4.Font");
+    luaL_argcheck(L, ud != NULL, arg, "`Font` expected");
+    return (fontType *)ud;
+}
+
+// Parses the RFF format written by font.encodeFontdata2 into a glyph atlas
+static int gpu_new_font(lua_State *L) {
+    size_t len;
+    const uint8_t *data = (const uint8_t *)luaL_checklstring(L, 1, &len);
+
+    if (len < 12 || memcmp(data, "FNT", 3) != 0) {
+        return luaL_error(L, "Corrupted Font File");
+    }
+
+    if (data[3] != 1) {
+        SDL_Log("Invalid font file version (F:%d, CV:1), results may vary", data[3]);
+    }
+
+    int charW = data[4];
+    int charH = data[5];
+    int rngLow = data[6];
+    int rngHi = data[7];
+
+    if (rngHi < rngLow) {
+        return luaL_error(L, "Corrupted Font File");
+    }
+
+    int glyphCount = rngHi - rngLow + 1;
+    int srq = (charW + 7) / 8;
+
+    // Every glyph row is srq bytes, a short file would leave glyphs unread
+    if (len - 12 < (size_t)glyphCount * charH * srq) {
+        return luaL_error(L, "Corrupted Font File");
+    }
+
+    fontType *font = (fontType *)lua_newuserdata(L, sizeof(fontType));
+    font->width = charW;
+    font->height = charH;
+    font->rangeLow = rngLow;
+    font->rangeHigh = rngHi;
+    font->glyphs = (uint8_t *)malloc((size_t)glyphCount * charW * charH + 1);
+    if (font->glyphs == NULL) {
+        return luaL_error(L, "Unable to allocate font");
+    }
+
+    luaL_getmetatable(L, "Riko4.Font");
+    lua_setmetatable(L, -2);
+
+    size_t pos = 12;
+    uint8_t *glyph = font->glyphs;
+    for (int i = 0; i < glyphCount; i++) {
+        for (int y = 0; y < charH; y++) {
+            for (int x = 0; x < charW; x++) {
+                size_t byte = pos + x / 8;
+                int shift = charW - x % 8 - 1;
+                glyph[y * charW + x] = byte < len && shift < 8 && (data[byte] & (1 << shift)) ? 1 : 0;
+            }
+            pos += srq;
+        }
+        glyph += charW * charH;
+    }
+
+    return 1;
+}
+
+static int fontGC(lua_State *L) {
+    fontType *font = checkFont(L, 1);
+    free(font->glyphs);
+    font->glyphs = NULL;
+
+    return 0;
+}
+
+static int fontGetWidth(lua_State *L) {
+    lua_pushinteger(L, checkFont(L, 1)->width);
+    return 1;
+}
+
+static int fontGetHeight(lua_State *L) {
+    lua_pushinteger(L, checkFont(L, 1)->height);
+    return 1;
+}
+
+static int gpu_set_font(lua_State *L) {
+    fontType *font = checkFont(L, 1);
+    if (font == currentFont) return 0;
+
+    // Hold a reference so the active font can't be collected from under us
+    luaL_unref(L, LUA_REGISTRYINDEX, currentFontRef);
+    lua_pushvalue(L, 1);
+    currentFontRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    currentFont = font;
+
+    return 0;
+}
+
+static void screenDrawText(const char *str, size_t len, int x, int y, int fg, int bg) {
+    fontType *font = currentFont;
+    int w = font->width;
+    int h = font->height;
+
+    for (size_t i = 0; i < len; i++, x += w + 1) {
+        if (bg >= 0) {
+            screenFillRect(x, y, w + 1, h + 1, (uint8_t)bg);
+        }
+
+        int c = (uint8_t)str[i];
+        if (c < font->rangeLow || c > font->rangeHigh) continue;
+
+        int x0 = x < clipX ? clipX - x : 0;
+        int y0 = y < clipY ? clipY - y : 0;
+        int x1 = x + w > clipX + clipW ? clipX + clipW - x : w;
+        int y1 = y + h > clipY + clipH ? clipY + clipH - y : h;
+
+        const uint8_t *glyph = font->glyphs + (c - font->rangeLow) * w * h;
+        for (int gy = y0; gy < y1; gy++) {
+            uint8_t *row = currentTarget.pixels + (y + gy) * currentTarget.pitch + x;
+            const uint8_t *glyphRow = glyph + gy * w;
+            for (int gx = x0; gx < x1; gx++) {
+                if (glyphRow[gx]) row[gx] = (uint8_t)fg;
+            }
+        }
+        screenMarkDirty(x + x0, y + y0, x + x1, y + y1);
     }
+}
+
+static int gpu_draw_text(lua_State *L) {
+    size_t len;
+    const char *str = luaL_checklstring(L, 1, &len);
+    int x = luaL_checkint(L, 2);
+    int y = luaL_checkint(L, 3);
+    int fg = getColor(L, 4);
+    int bg = lua_isnoneornil(L, 5) ? -1 : getColor(L, 5);
+
+    if (currentFont == NULL) {
+        return luaL_error(L, "No font has been set, use gpu.setFont");
+    }
+
+    screenDrawText(str, len, off(x, y), fg, bg);
 
     return 0;
 }
 
 static int gpu_set_clipping(lua_State *L) {
     if (lua_gettop(L) == 0) {
-        GPU_SetClip(buffer->target, 0, 0, buffer->w, buffer->h);
+        clipX = 0;
+        clipY = 0;
+        clipW = currentTarget.width;
+        clipH = currentTarget.height;
         return 0;
     }
 
@@ -144,7 +651,13 @@ static int gpu_set_clipping(lua_State *L) {
     int w = luaL_checkint(L, 3);
     int h = luaL_checkint(L, 4);
 
-    GPU_SetClip(buffer->target, x, y, w, h);
+    // Keep the clip rect inside the target so writes never need a second bounds check
+    int x1 = x + w > currentTarget.width ? currentTarget.width : x + w;
+    int y1 = y + h > currentTarget.height ? currentTarget.height : y + h;
+    clipX = x < 0 ? 0 : x;
+    clipY = y < 0 ? 0 : y;
+    clipW = x1 > clipX ? x1 - clipX : 0;
+    clipH = y1 > clipY ? y1 - clipY : 0;
 
     return 0;
 }
@@ -220,32 +733,148 @@ static int gpu_get_palette(lua_State *L) {
 static int gpu_get_pixel(lua_State *L) {
     int x = luaL_checkint(L, 1);
     int y = luaL_checkint(L, 2);
-    SDL_Color col = GPU_GetPixel(buffer->target, x, y);
-    for (int i = 0; i < 16; i++) {
-        int* pcol = palette[i];
-        if (col.r == pcol[0] && col.g == pcol[1] && col.b == pcol[2]) {
-            lua_pushinteger(L, i + 1);
-            return 1;
-        }
+
+    if (x < 0 || y < 0 || x >= currentTarget.width || y >= currentTarget.height) {
+        lua_pushinteger(L, 1);
+        return 1;
     }
 
-    lua_pushinteger(L, 1); // Should never happen
+    // Wraps transparent Image pixels to 0, as in getPixels
+    lua_pushinteger(L, (uint8_t)(currentTarget.pixels[y * currentTarget.pitch + x] + 1));
     return 1;
 }
 
-static int gpu_clear(lua_State *L) {
-    if (lua_gettop(L) > 0) {
-        int color = getColor(L, 1);
-        SDL_Color colorS = {palette[(int)color][0], palette[(int)color][1], palette[(int)color][2], 255};
-        GPU_ClearColor(bufferTarget, colorS);
+// gpu.getPixels(x, y, w, h[, dst[, stride]]) reads a block of the target as
+// one byte per pixel (1-16, same as getPixel, 1 outside the target and 0 for
+// transparent Image pixels). Returns a string, or fills dst (lightuserdata, FFI
+// pointer or FFI array, which must hold the whole block) when given.
+static int gpu_get_pixels(lua_State *L) {
+    int x = luaL_checkint(L, 1);
+    int y = luaL_checkint(L, 2);
+    int w = luaL_checkint(L, 3);
+    int h = luaL_checkint(L, 4);
+    int stride = luaL_optint(L, 6, w);
+
+    bool toString = lua_isnoneornil(L, 5);
+    if (w <= 0 || h <= 0) {
+        if (!toString) return 0;
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    uint8_t *dst;
+    if (toString) {
+        if ((size_t)w > SIZE_MAX / (size_t)h) {
+            return luaL_error(L, "getPixels block too large");
+        }
+
+        stride = w;
+        dst = (uint8_t *)malloc((size_t)w * h);
+        if (dst == NULL) {
+            return luaL_error(L, "not enough memory for getPixels");
+        }
     } else {
-        SDL_Color colorS = { palette[0][0], palette[0][1], palette[0][2], 255 };
-        GPU_ClearColor(bufferTarget, colorS);
+        luaL_argcheck(L, lua_type(L, 5) == LUA_TLIGHTUSERDATA || lua_type(L, 5) == LUA_TCDATA, 5, "pointer expected");
+        dst = (uint8_t *)checkPixelBytes(L, 5, w, h, stride);
+        luaL_argcheck(L, dst != NULL, 5, "pointer expected");
+    }
+
+    int x0 = x < 0 ? -x : 0;
+    int x1 = w > currentTarget.width - x ? currentTarget.width - x : w;
+    if (x1 < x0) x1 = x0;
+
+    for (int yp = 0; yp < h; yp++) {
+        uint8_t *row = dst + (size_t)yp * stride;
+        int sy = y + yp;
+        if (sy < 0 || sy >= currentTarget.height || x1 <= x0) {
+            memset(row, 1, w);
+            continue;
+        }
+
+        memset(row, 1, x0);
+        const uint8_t *src = currentTarget.pixels + sy * currentTarget.pitch + x;
+        for (int xp = x0; xp < x1; xp++) {
+            row[xp] = (uint8_t)(src[xp] + 1);
+        }
+        memset(row + x1, 1, w - x1);
+    }
+
+    if (toString) {
+        lua_pushlstring(L, (const char *)dst, (size_t)w * h);
+        free(dst);
+        return 1;
     }
 
     return 0;
 }
 
+static int gpu_clear(lua_State *L) {
+    int color = lua_gettop(L) > 0 ? getColor(L, 1) : 0;
+
+    screenFillRect(clipX, clipY, clipW, clipH, (uint8_t)color);
+
+    return 0;
+}
+
+// Makes the draw target the screen again, restoring its clip rect
+void resetDrawTarget(lua_State *L) {
+    if (currentTarget.pixels == screenBuffer) return;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, currentTargetRef);
+    currentTargetRef = LUA_NOREF;
+
+    currentTarget.pixels = screenBuffer;
+    currentTarget.width = SCRN_WIDTH;
+    currentTarget.height = SCRN_HEIGHT;
+    currentTarget.pitch = SCRN_WIDTH;
+
+    clipX = screenClip[0];
+    clipY = screenClip[1];
+    clipW = screenClip[2];
+    clipH = screenClip[3];
+}
+
+// gpu.setTarget(image) sends every gpu.* draw call, and Image and SpriteSheet
+// rendering, into the Image until gpu.setTarget() switches back to the screen.
+// The clip rect starts out as the whole Image, translation carries over.
+static int gpu_set_target(lua_State *L) {
+    if (lua_isnoneornil(L, 1)) {
+        resetDrawTarget(L);
+        return 0;
+    }
+
+    drawTarget t;
+    checkImageTarget(L, 1, &t);
+
+    if (currentTarget.pixels == screenBuffer) {
+        screenClip[0] = clipX;
+        screenClip[1] = clipY;
+        screenClip[2] = clipW;
+        screenClip[3] = clipH;
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, currentTargetRef);
+    lua_pushvalue(L, 1);
+    currentTargetRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    currentTarget = t;
+    clipX = 0;
+    clipY = 0;
+    clipW = t.width;
+    clipH = t.height;
+
+    return 0;
+}
+
+static int gpu_get_target(lua_State *L) {
+    if (currentTargetRef == LUA_NOREF) {
+        lua_pushnil(L);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, currentTargetRef);
+    }
+    return 1;
+}
+
 int* translateStack;
 int tStackUsed = 0;
 int tStackSize = 32;
@@ -287,6 +916,8 @@ static int gpu_pop(lua_State *L) {
 }
 
 static int gpu_set_fullscreen(lua_State *L) {
+    if (headless) return 0;
+
     bool fsc = lua_toboolean(L, 1);
     GPU_SetFullscreen(fsc, true);
 
@@ -299,21 +930,150 @@ static int gpu_set_fullscreen(lua_State *L) {
     afPixscale = *winH / SCRN_HEIGHT;
     free(winH);
 
+    forcePresent = true;
+
     return 0;
 }
 
+// Uploads rows y0..y1 (exclusive) of the dirty box that actually differ from
+// what the texture holds, as a rect trimmed to the changed columns
+static void uploadBand(int y0, int y1, int x0, int x1) {
+    int minX = x1;
+    int maxX = x0;
+
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *cur = screenBuffer + y * SCRN_WIDTH;
+        const uint8_t *old = uploadedScreen + y * SCRN_WIDTH;
+
+        int l = x0;
+        while (l < x1 && cur[l] == old[l]) l++;
+        if (l == x1) continue;
+
+        int r = x1;
+        while (cur[r - 1] == old[r - 1]) r--;
+
+        if (l < minX) minX = l;
+        if (r > maxX) maxX = r;
+    }
+
+    if (maxX <= minX) return;
+
+    for (int y = y0; y < y1; y++) {
+        memcpy(uploadedScreen + y * SCRN_WIDTH + minX, screenBuffer + y * SCRN_WIDTH + minX, maxX - minX);
+    }
+
+    GPU_Rect rect = { (float)minX, (float)y0, (float)(maxX - minX), (float)(y1 - y0) };
+    GPU_UpdateImageBytes(buffer, &rect, screenBuffer + y0 * SCRN_WIDTH + minX, SCRN_WIDTH);
+}
+
+// Uploads the changed parts of the dirty box, returns whether anything changed.
+// Changed rows are grouped into bands, small gaps are merged to save on uploads.
+static bool uploadDirty() {
+    if (!textureValid) {
+        GPU_UpdateImageBytes(buffer, NULL, screenBuffer, SCRN_WIDTH);
+        memcpy(uploadedScreen, screenBuffer, sizeof(uploadedScreen));
+        textureValid = true;
+        dirtyX1 = dirtyX0;
+        return true;
+    }
+
+    if (dirtyX1 <= dirtyX0) return false;
+
+    const int mergeGap = 4;
+    bool changed = false;
+    int bandStart = -1;
+    int bandEnd = -1;
+    size_t span = dirtyX1 - dirtyX0;
+
+    for (int y = dirtyY0; y < dirtyY1; y++) {
+        size_t o = y * SCRN_WIDTH + dirtyX0;
+        if (memcmp(screenBuffer + o, uploadedScreen + o, span) == 0) continue;
+
+        changed = true;
+        if (bandStart >= 0 && y - bandEnd > mergeGap) {
+            uploadBand(bandStart, bandEnd, dirtyX0, dirtyX1);
+            bandStart = -1;
+        }
+        if (bandStart < 0) bandStart = y;
+        bandEnd = y + 1;
+    }
+
+    if (bandStart >= 0) {
+        uploadBand(bandStart, bandEnd, dirtyX0, dirtyX1);
+    }
+
+    dirtyX1 = dirtyX0;
+    return changed;
+}
+
+// When the last frame was presented, and the display's refresh rate
+static Uint64 lastPresent = 0;
+static int refreshRate = 0;
+
+// A skipped present still waits out the rest of the display interval. The
+// vsync in GPU_Flip is what paces scripts that swap on every resume, such as
+// the shell, so without this they would redraw as fast as the loop spins.
+static void waitForRefresh() {
+#ifndef __EMSCRIPTEN__
+    if (refreshRate == 0) {
+        SDL_DisplayMode mode;
+        SDL_Window *window = SDL_GetWindowFromID(renderer->renderer->current_context_target->context->windowID);
+        refreshRate = window != NULL && SDL_GetWindowDisplayMode(window, &mode) == 0 && mode.refresh_rate > 0 ? mode.refresh_rate : 60;
+    }
+
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 next = lastPresent + freq / refreshRate;
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    if (now < next) {
+        SDL_Delay((Uint32)((next - now) * 1000 / freq));
+        lastPresent = next;
+    } else {
+        lastPresent = now;
+    }
+#endif
+}
+
+// gpu.swap([force]), returns whether a frame was presented. Nothing is uploaded
+// or flipped when the screen and palette are unchanged, unless force is set.
 static int gpu_swap(lua_State *L) {
+    audioFileFrame();
+
+    if (headless) {
+        headlessPresent(screenBuffer, palette);
+        dirtyX1 = dirtyX0;
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    bool changed = uploadDirty();
+    bool paletteChanged = uploadedPaletteNum != paletteNum;
+
+    if (!changed && !paletteChanged && !forcePresent && !lua_toboolean(L, 1)) {
+        waitForRefresh();
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    forcePresent = false;
+
     GPU_Clear(renderer);
 
     updateShader();
 
+    if (paletteChanged) {
+        updateShaderPalette(palette);
+        uploadedPaletteNum = paletteNum;
+    }
+
     GPU_BlitRect(buffer, NULL, renderer, NULL);
 
     GPU_Flip(renderer);
+    lastPresent = SDL_GetPerformanceCounter();
 
     GPU_DeactivateShaderProgram();
 
-    return 0;
+    lua_pushboolean(L, true);
+    return 1;
 }
 
 static const luaL_Reg gpuLib[] = {
@@ -322,21 +1082,54 @@ static const luaL_Reg gpuLib[] = {
     { "getPalette", gpu_get_palette },
     { "drawPixel", gpu_draw_pixel },
     { "drawRectangle", gpu_draw_rectangle },
+    { "drawRectangles", gpu_draw_rectangles },
+    { "drawPixels", gpu_draw_pixels },
+    { "drawLine", gpu_draw_line },
+    { "drawCircle", gpu_draw_circle },
+    { "fillCircle", gpu_fill_circle },
+    { "drawEllipse", gpu_draw_ellipse },
+    { "fillEllipse", gpu_fill_ellipse },
+    { "fillPolygon", gpu_fill_polygon },
+    { "fillTriangle", gpu_fill_triangle },
     { "blitPixels", gpu_blit_pixels },
     { "translate", gpu_translate },
     { "push", gpu_push },
     { "pop", gpu_pop },
     { "setFullscreen", gpu_set_fullscreen },
     { "getPixel", gpu_get_pixel },
+    { "getPixels", gpu_get_pixels },
     { "clear", gpu_clear },
     { "swap", gpu_swap },
     { "clip", gpu_set_clipping },
+    { "setTarget", gpu_set_target },
+    { "getTarget", gpu_get_target },
+    { "newFont", gpu_new_font },
+    { "setFont", gpu_set_font },
+    { "drawText", gpu_draw_text },
     {NULL, NULL}
 };
 
+static const luaL_Reg fontLib_m[] = {
+    { "getWidth", fontGetWidth },
+    { "getHeight", fontGetHeight },
+    { NULL, NULL }
+};
+
 LUALIB_API int luaopen_gpu(lua_State *L) {
     translateStack = (int *)malloc(32 * sizeof(int));
 
+    luaL_newmetatable(L, "Riko4.Font");
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);  /* pushes the metatable */
+    lua_settable(L, -3);  /* metatable.__index = metatable */
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, fontGC);
+    lua_settable(L, -3);
+
+    luaL_openlib(L, NULL, fontLib_m, 0);
+    lua_pop(L, 1);
+
     luaL_openlib(L, RIKO_GPU_NAME, gpuLib, 0);
     lua_pushnumber(L, SCRN_WIDTH);
     lua_setfield(L, -2, "width");
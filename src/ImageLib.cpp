@@ -1,63 +1,69 @@
 #define LUA_LIB
 
+#define _CRT_SECURE_NO_WARNINGS
+
 #include <cstdlib>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#include "rikoConsts.h"
+
 #include "rikoImage.h"
+#include "rikoGPU.h"
+#include "rikoFs.h"
+#include "blit.h"
+#include "raster.h"
 
 #include "luaIncludes.h"
 #include <SDL2/SDL.h>
-#include "SDL_gpu/SDL_gpu.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 #define clamp(v, min, max) (v < min ? min : (v > max ? max : v))
 
-extern GPU_Target *bufferTarget;
-extern GPU_Target *renderer;
 extern int pixelSize;
-extern int palette[16][3];
-extern int paletteNum;
 
 extern int drawOffX;
 extern int drawOffY;
 
+extern int clipX;
+extern int clipY;
+extern int clipW;
+extern int clipH;
+
 #define off(o, t) o - drawOffX, t - drawOffY
 
 typedef struct {
     int width;
     int height;
+    int pitch;
     bool free;
     int clr;
-    int lastRenderNum;
     int remap[16];
-    bool remapped;
-    char **internalRep;
-    SDL_Surface *surface;
-    GPU_Image *texture;
+    // One palette index per pixel, row-major with pitch bytes per row, in a
+    // single 16 byte aligned block. IMAGE_TRANSPARENT marks empty pixels.
+    uint8_t *pixels;
+    // Size of the pooled block behind pixels, and whether it came from
+    // image.newScratch and goes back to the scratch lists
+    size_t capacity;
+    bool scratch;
 } imageType;
 
 static float pWid = 1;
 static float pHei = 1;
 
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-    int rmask = 0xff000000;
-    int gmask = 0x00ff0000;
-    int bmask = 0x0000ff00;
-    int amask = 0x000000ff;
-#else
-    int rmask = 0x000000ff;
-    int gmask = 0x0000ff00;
-    int bmask = 0x00ff0000;
-    int amask = 0xff000000;
-#endif
-
-static int getColor(lua_State *L, int arg) {
-    int color = (int)luaL_checkint(L, arg) - 1;
+// Maps a 1-16 color to a palette index, or -1 for the transparent color -1
+static inline int toImageColor(int color) {
+    color -= 1;
     return color == -2 ? -1 : (color < 0 ? 0 : (color > 15 ? 15 : color));
 }
 
-static Uint32 getRectC(imageType *data, int colorGiven) {
-    int color = data->remap[colorGiven]; // Palette remapping
-    return SDL_MapRGBA(data->surface->format, palette[color][0], palette[color][1], palette[color][2], 255);
+static int getColor(lua_State *L, int arg) {
+    return toImageColor((int)luaL_checkint(L, arg));
 }
 
 static imageType *checkImage(lua_State *L) {
@@ -74,122 +80,532 @@ bool freeCheck(lua_State *L, imageType *data) {
     return true;
 }
 
-static int newImage(lua_State *L) {
-    int w = luaL_checkint(L, 1);
-    int h = luaL_checkint(L, 2);
+static uint8_t *allocBlock(size_t size) {
+#ifdef _WIN32
+    return (uint8_t *)_aligned_malloc(size, 16);
+#else
+    void *mem;
+    return posix_memalign(&mem, 16, size) == 0 ? (uint8_t *)mem : NULL;
+#endif
+}
+
+static void freeBlock(uint8_t *block) {
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+// Pixel blocks are recycled through power of two size classes, from 256 bytes
+// up to 4MB, with each free list linked through the first bytes of its blocks.
+// Blocks from regular Images are kept up to POOL_MAX_BYTES, scratch blocks
+// have their own lists and are always kept, so a scratch Image never hits the
+// allocator once a block of its class has been freed.
+#define POOL_MIN_SHIFT 8
+#define POOL_MAX_SHIFT 22
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_BYTES (8 * 1024 * 1024)
+
+// Indexed by whether the blocks are scratch ones, only the regular count is capped
+static uint8_t *pool[2][POOL_CLASSES];
+static size_t pooledBytes[2];
+static size_t pooledBlocks[2];
+static size_t poolHits = 0;
+static size_t poolMisses = 0;
+
+static int poolClass(size_t size) {
+    int cls = 0;
+    while (((size_t)1 << (cls + POOL_MIN_SHIFT)) < size) cls++;
+    return cls;
+}
+
+static uint8_t *allocPixels(size_t size, bool scratch, size_t *capacity) {
+    if (size > ((size_t)1 << POOL_MAX_SHIFT)) {
+        poolMisses++;
+        *capacity = size;
+        return allocBlock(size);
+    }
+
+    int cls = poolClass(size);
+    *capacity = (size_t)1 << (cls + POOL_MIN_SHIFT);
+
+    // Scratch blocks stay with scratch Images, so they are there for the next one
+    uint8_t **list = &pool[scratch][cls];
+
+    uint8_t *block = *list;
+    if (block != NULL) {
+        memcpy(list, block, sizeof(uint8_t *));
+        pooledBytes[scratch] -= *capacity;
+        pooledBlocks[scratch]--;
+        poolHits++;
+        return block;
+    }
+
+    poolMisses++;
+    return allocBlock(*capacity);
+}
+
+static void freePixels(uint8_t *pixels, size_t capacity, bool scratch) {
+    if (capacity > ((size_t)1 << POOL_MAX_SHIFT) || (!scratch && pooledBytes[0] + capacity > POOL_MAX_BYTES)) {
+        freeBlock(pixels);
+        return;
+    }
+
+    uint8_t **list = &pool[scratch][poolClass(capacity)];
+    memcpy(pixels, list, sizeof(uint8_t *));
+    *list = pixels;
+    pooledBytes[scratch] += capacity;
+    pooledBlocks[scratch]++;
+}
+
+// Pushes a new w x h Image, fully transparent
+static imageType *pushImage(lua_State *L, int w, int h, bool scratch = false) {
     size_t nbytes = sizeof(imageType);
     imageType *a = (imageType *)lua_newuserdata(L, nbytes);
 
     luaL_getmetatable(L, "Riko4.Image");
     lua_setmetatable(L, -2);
 
-    a->width = w;
-    a->height = h;
     a->free = false;
     a->clr = 0;
-    a->lastRenderNum = paletteNum;
     for (int i = 0; i < 16; i++) {
         a->remap[i] = i;
     }
 
-    a->internalRep = (char **) malloc(sizeof (char *) * w);
-    for (int i = 0; i < w; i++) {
-        a->internalRep[i] = (char *) malloc(sizeof (char) * h);
-        memset(a->internalRep[i], -1, h);
+    a->width = w < 0 ? 0 : w;
+    a->height = h < 0 ? 0 : h;
+    a->pitch = (a->width + 15) & ~15;
+
+    a->scratch = scratch;
+    a->pixels = allocPixels((size_t)a->pitch * a->height, scratch, &a->capacity);
+    if (a->pixels == NULL) {
+        a->free = true;
+        luaL_error(L, "Unable to allocate %dx%d Image", w, h);
+        return NULL;
     }
 
-    a->surface = SDL_CreateRGBSurface(0, w, h, 32, rmask, gmask, bmask, amask);
+    // Recycled blocks hold old pixels and a free list link, which could be
+    // indices past the 16 entry remap tables
+    memset(a->pixels, IMAGE_TRANSPARENT, (size_t)a->pitch * a->height);
+
+    return a;
+}
+
+void checkImageTarget(lua_State *L, int arg, drawTarget *t) {
+    void *ud = luaL_checkudata(L, arg, "Riko4.Image");
+    luaL_argcheck(L, ud != NULL, arg, "`Image` expected");
+    imageType *data = (imageType *)ud;
+    freeCheck(L, data);
+
+    t->pixels = data->pixels;
+    t->width = data->width;
+    t->height = data->height;
+    t->pitch = data->pitch;
+}
+
+static int newImage(lua_State *L) {
+    pushImage(L, luaL_checkint(L, 1), luaL_checkint(L, 2));
+    return 1;
+}
 
-    // Init to black color
-    SDL_FillRect(a->surface, NULL, SDL_MapRGBA(a->surface->format, 0, 0, 0, 0));
+// Like newImage, but the block comes from and goes back to the scratch pool,
+// for short lived Images made every frame
+static int newScratch(lua_State *L) {
+    pushImage(L, luaL_checkint(L, 1), luaL_checkint(L, 2), true);
+    return 1;
+}
 
-    a->texture = GPU_CopyImageFromSurface(a->surface);
-    GPU_SetImageFilter(a->texture, GPU_FILTER_NEAREST);
-    GPU_SetSnapMode(a->texture, GPU_SNAP_NONE);
+// image.getPoolStats() counts hits and misses over both pools, and the idle
+// blocks of regular (pooled*) and scratch (scratch*) Images separately
+static int getPoolStats(lua_State *L) {
+    lua_createtable(L, 0, 7);
+
+    lua_pushnumber(L, (lua_Number)poolHits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, (lua_Number)poolMisses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, poolHits + poolMisses == 0 ? 0 : (lua_Number)poolHits / (poolHits + poolMisses));
+    lua_setfield(L, -2, "hitRate");
+    lua_pushnumber(L, (lua_Number)pooledBytes[0]);
+    lua_setfield(L, -2, "pooledBytes");
+    lua_pushnumber(L, (lua_Number)pooledBlocks[0]);
+    lua_setfield(L, -2, "pooledBlocks");
+    lua_pushnumber(L, (lua_Number)pooledBytes[1]);
+    lua_setfield(L, -2, "scratchBytes");
+    lua_pushnumber(L, (lua_Number)pooledBlocks[1]);
+    lua_setfield(L, -2, "scratchBlocks");
 
     return 1;
 }
 
-static int flushImage(lua_State *L) {
-    imageType *data = checkImage(L);
-    if (!freeCheck(L, data)) return 0;
+// RIF v2 layout: "RIV", version, width and height as big endian 16 bit, a
+// transparency flag and 10 reserved bytes. Then the pixels as packed nibbles
+// (color - 1, high nibble first) and, when flagged, a transparency bitmap with
+// one bit per pixel, least significant bit first.
+#define RIF_VERSION 2
+#define RIF_HEADER_SIZE 19
 
-    GPU_Rect rect = { 0, 0, data->width, data->height };
-    GPU_UpdateImage(data->texture, &rect, data->surface, &rect);
+static int decodeRIFData(lua_State *L, const uint8_t *data, size_t len) {
+    if (len < RIF_HEADER_SIZE || memcmp(data, "RIV", 3) != 0) {
+        return luaL_error(L, "Data does not contain correct RIF signature, possibly corrupted data");
+    }
 
-    return 0;
+    if (data[3] != RIF_VERSION) {
+        SDL_Log("RIF data has different version (F:%d, CV:%d), image may not look right", data[3], RIF_VERSION);
+    }
+
+    int w = data[4] * 256 + data[5];
+    int h = data[6] * 256 + data[7];
+    bool hasTransparency = data[8] == 1;
+
+    size_t count = (size_t)w * h;
+    size_t pixelBytes = (count + 1) / 2;
+    size_t needed = RIF_HEADER_SIZE + pixelBytes + (hasTransparency ? (count + 7) / 8 : 0);
+    if (len < needed) {
+        return luaL_error(L, "RIF data is truncated, expected %d bytes, got %d", (int)needed, (int)len);
+    }
+
+    imageType *img = pushImage(L, w, h);
+
+    const uint8_t *nibbles = data + RIF_HEADER_SIZE;
+    const uint8_t *transMap = hasTransparency ? nibbles + pixelBytes : NULL;
+
+    size_t k = 0;
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = img->pixels + y * img->pitch;
+        for (int x = 0; x < w; x++, k++) {
+            if (transMap && (transMap[k >> 3] & (1 << (k & 7)))) continue;
+
+            uint8_t b = nibbles[k >> 1];
+            row[x] = (k & 1) ? (b & 15) : (b >> 4);
+        }
+    }
+
+    lua_pushinteger(L, w);
+    lua_pushinteger(L, h);
+    return 3;
 }
 
-static int renderImage(lua_State *L) {
+// image.decodeRIF(data) returns a new Image and its width and height
+static int imageDecodeRIF(lua_State *L) {
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+
+    return decodeRIFData(L, (const uint8_t *)data, len);
+}
+
+// image.loadRIF(pathOrData) accepts either a path in the fs sandbox or RIF data
+static int imageLoadRIF(lua_State *L) {
+    size_t len;
+    const char *arg = luaL_checklstring(L, 1, &len);
+    if (len >= RIF_HEADER_SIZE && memcmp(arg, "RIV", 3) == 0) {
+        return decodeRIFData(L, (const uint8_t *)arg, len);
+    }
+
+    char filePath[MAX_PATH + 1];
+    fsResolvePath(L, arg, filePath);
+
+    FILE *f = fopen(filePath, "rb");
+    if (f == NULL) {
+        return luaL_error(L, "No such file");
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *data = (uint8_t *)malloc(size > 0 ? size : 1);
+    size_t got = fread(data, 1, size > 0 ? size : 0, f);
+    fclose(f);
+
+    // Copy the data into a Lua string so the buffer can't leak if decoding errors
+    lua_pushlstring(L, (const char *)data, got);
+    free(data);
+
+    const char *str = lua_tolstring(L, -1, &len);
+    return decodeRIFData(L, (const uint8_t *)str, len);
+}
+
+// image:encodeRIF() returns the image as RIF data
+static int imageEncodeRIF(lua_State *L) {
+    imageType *img = checkImage(L);
+    if (!freeCheck(L, img)) return 0;
+
+    int w = img->width > 65535 ? 65535 : img->width;
+    int h = img->height > 65535 ? 65535 : img->height;
+
+    size_t count = (size_t)w * h;
+    size_t pixelBytes = (count + 1) / 2;
+    size_t size = RIF_HEADER_SIZE + pixelBytes + (count + 7) / 8;
+
+    uint8_t *out = (uint8_t *)calloc(size, 1);
+    memcpy(out, "RIV", 3);
+    out[3] = RIF_VERSION;
+    out[4] = (uint8_t)(w >> 8);
+    out[5] = (uint8_t)(w & 255);
+    out[6] = (uint8_t)(h >> 8);
+    out[7] = (uint8_t)(h & 255);
+    out[8] = 1;
+
+    uint8_t *nibbles = out + RIF_HEADER_SIZE;
+    uint8_t *transMap = nibbles + pixelBytes;
+
+    size_t k = 0;
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = img->pixels + y * img->pitch;
+        for (int x = 0; x < w; x++, k++) {
+            uint8_t c = row[x];
+            if (c == IMAGE_TRANSPARENT) {
+                transMap[k >> 3] |= (uint8_t)(1 << (k & 7));
+                continue;
+            }
+
+            nibbles[k >> 1] |= (k & 1) ? c : (uint8_t)(c << 4);
+        }
+    }
+
+    lua_pushlstring(L, (const char *)out, size);
+    free(out);
+
+    return 1;
+}
+
+// Images only hold palette indices which are composited on the CPU, so every
+// write is visible on the next render and there is nothing to upload. Kept so
+// existing scripts calling flush still work.
+static int flushImage(lua_State *L) {
     imageType *data = checkImage(L);
     if (!freeCheck(L, data)) return 0;
 
-    if (data->lastRenderNum != paletteNum || data->remapped) {
-        int rectcolor = SDL_MapRGBA(data->surface->format, 0, 0, 0, 0);
-        SDL_FillRect(data->surface, NULL, rectcolor);
+    return 0;
+}
 
-        for (int x = 0; x < data->width; x++) {
-            for (int y = 0; y < data->height; y++) {
-                SDL_Rect rect = { x, y, 1, 1 };
-                int c = data->internalRep[x][y];
-                if (c >= 0)
-                    SDL_FillRect(data->surface, &rect, getRectC(data, c));
+static void buildLut(imageType *data, uint8_t lut[16]) {
+    for (int i = 0; i < 16; i++) {
+        lut[i] = (uint8_t)data->remap[i];
+    }
+}
+
+// Composites a (scaled) region of the image into the draw target, transparent
+// pixels are skipped and the image's palette remapping is applied on the way
+static void compositeImage(imageType *data, int dx, int dy, int sx, int sy, int sw, int sh, int scale) {
+    if (scale <= 0 || sw <= 0 || sh <= 0) return;
+
+    int dw = sw * scale;
+    int dh = sh * scale;
+
+    int x0 = dx < clipX ? clipX : dx;
+    int y0 = dy < clipY ? clipY : dy;
+    int x1 = dx + dw > clipX + clipW ? clipX + clipW : dx + dw;
+    int y1 = dy + dh > clipY + clipH ? clipY + clipH : dy + dh;
+
+    uint8_t lut[16];
+    buildLut(data, lut);
+
+    // Keep the source columns inside the image, so the inner loop only has to
+    // check for transparency
+    if (sx < 0 && x0 < dx - sx * scale) x0 = dx - sx * scale;
+    if (x1 > dx + (data->width - sx) * scale) x1 = dx + (data->width - sx) * scale;
+
+    for (int yp = y0; yp < y1; yp++) {
+        int srcY = sy + (yp - dy) / scale;
+        if (srcY < 0 || srcY >= data->height) continue;
+
+        const uint8_t *src = data->pixels + srcY * data->pitch;
+        uint8_t *row = currentTarget.pixels + yp * currentTarget.pitch;
+        if (scale == 1) {
+            blitIndexedRow(row + x0, src + sx - dx + x0, x1 - x0, lut);
+        } else {
+            for (int xp = x0; xp < x1; xp++) {
+                uint8_t c = src[sx + (xp - dx) / scale];
+                if (c != IMAGE_TRANSPARENT && lut[c] != IMAGE_TRANSPARENT)
+                    row[xp] = lut[c];
             }
         }
+    }
+    screenMarkDirty(x0, y0, x1, y1);
+}
 
-        GPU_Rect rect = { 0, 0, data->width, data->height };
-        GPU_UpdateImage(data->texture, &rect, data->surface, &rect);
-
-        data->lastRenderNum = paletteNum;
-        data->remapped = false;
+// render, renderEx and SpriteSheet draws read and write rows in place, copy
+// stages the source
+static bool targetCheck(lua_State *L, imageType *data) {
+    if (data->pixels == currentTarget.pixels) {
+        luaL_error(L, "Attempt to render an Image into itself, use image:copy");
+        return false;
     }
+    return true;
+}
+
+static int renderImage(lua_State *L) {
+    imageType *data = checkImage(L);
+    if (!freeCheck(L, data) || !targetCheck(L, data)) return 0;
 
     int x = luaL_checkint(L, 2);
     int y = luaL_checkint(L, 3);
 
-    GPU_Rect rect = { off(x, y) };
-
     int top = lua_gettop(L);
     if (top > 7) {
-        GPU_Rect srcRect = {
-            luaL_checkint(L, 4),
-            luaL_checkint(L, 5),
-            clamp(luaL_checkint(L, 6), 0, data->width),
-            clamp(luaL_checkint(L, 7), 0, data->height)
-        };
+        int sx = luaL_checkint(L, 4);
+        int sy = luaL_checkint(L, 5);
+        int sw = clamp(luaL_checkint(L, 6), 0, data->width);
+        int sh = clamp(luaL_checkint(L, 7), 0, data->height);
 
         int scale = luaL_checkint(L, 8);
 
-        rect.w = srcRect.w * scale;
-        rect.h = srcRect.h * scale;
-
-        GPU_BlitRect(data->texture, &srcRect, bufferTarget, &rect);
+        compositeImage(data, off(x, y), sx, sy, sw, sh, scale);
     } else if (top > 6) {
-        GPU_Rect srcRect = {
-            luaL_checkint(L, 4),
-            luaL_checkint(L, 5),
-            luaL_checkint(L, 6),
-            luaL_checkint(L, 7)
-        };
+        compositeImage(data, off(x, y), luaL_checkint(L, 4), luaL_checkint(L, 5),
+                       luaL_checkint(L, 6), luaL_checkint(L, 7), 1);
+    } else if (top > 3) {
+        compositeImage(data, off(x, y), 0, 0, luaL_checkint(L, 4), luaL_checkint(L, 5), 1);
+    } else {
+        compositeImage(data, off(x, y), 0, 0, data->width, data->height, 1);
+    }
 
-        rect.w = srcRect.w;
-        rect.h = srcRect.h;
+    return 0;
+}
 
-        GPU_BlitRect(data->texture, &srcRect, bufferTarget, &rect);
-    } else if (top > 3) {
-        GPU_Rect srcRect = { 0, 0, luaL_checkint(L, 4), luaL_checkint(L, 5) };
+typedef struct {
+    double scaleX;
+    double scaleY;
+    double rotation;
+    double originX;
+    double originY;
+    bool flipX;
+    bool flipY;
+} renderExOpts;
+
+// Composites the w x h region at (sx, sy) of the image with its origin placed
+// at (x, y), scaled, rotated clockwise by the given degrees and flipped. Every
+// covered target pixel maps its center back into the source and takes the
+// nearest texel, so indices and transparency pass through untouched.
+static void compositeImageEx(imageType *data, double x, double y, int sx, int sy, int w, int h,
+                             const renderExOpts *o) {
+    if (w <= 0 || h <= 0 || o->scaleX == 0 || o->scaleY == 0) return;
+
+    double rad = o->rotation * M_PI / 180.0;
+    double c = cos(rad);
+    double s = sin(rad);
+
+    // Target bounding box of the transformed source rect
+    double minX = 1e9, minY = 1e9, maxX = -1e9, maxY = -1e9;
+    for (int corner = 0; corner < 4; corner++) {
+        double lx = ((corner & 1) ? w : 0) - o->originX;
+        double ly = ((corner & 2) ? h : 0) - o->originY;
+        lx *= o->scaleX;
+        ly *= o->scaleY;
+
+        double px = x + c * lx - s * ly;
+        double py = y + s * lx + c * ly;
+        if (px < minX) minX = px;
+        if (px > maxX) maxX = px;
+        if (py < minY) minY = py;
+        if (py > maxY) maxY = py;
+    }
 
-        rect.w = srcRect.w;
-        rect.h = srcRect.h;
+    int x0 = (int)floor(minX);
+    int y0 = (int)floor(minY);
+    int x1 = (int)ceil(maxX);
+    int y1 = (int)ceil(maxY);
+    if (x0 < clipX) x0 = clipX;
+    if (y0 < clipY) y0 = clipY;
+    if (x1 > clipX + clipW) x1 = clipX + clipW;
+    if (y1 > clipY + clipH) y1 = clipY + clipH;
+    if (x1 <= x0 || y1 <= y0) return;
+
+    uint8_t lut[16];
+    buildLut(data, lut);
+
+    // Source coordinates step by a constant per screen pixel along a row
+    double duX = c / o->scaleX;
+    double dvX = -s / o->scaleY;
+
+    for (int py = y0; py < y1; py++) {
+        double dx = x0 + 0.5 - x;
+        double dy = py + 0.5 - y;
+        double u0 = o->originX + (c * dx + s * dy) / o->scaleX;
+        double v0 = o->originY + (-s * dx + c * dy) / o->scaleY;
+
+        uint8_t *row = currentTarget.pixels + py * currentTarget.pitch;
+        for (int px = x0; px < x1; px++) {
+            // Stepped from the row start rather than accumulated, so fractional
+            // scales don't drift across a row
+            int iu = (int)floor(u0 + duX * (px - x0));
+            int iv = (int)floor(v0 + dvX * (px - x0));
+            if (iu < 0 || iv < 0 || iu >= w || iv >= h) continue;
+
+            if (o->flipX) iu = w - 1 - iu;
+            if (o->flipY) iv = h - 1 - iv;
+
+            uint8_t p = data->pixels[(sy + iv) * data->pitch + sx + iu];
+            if (p == IMAGE_TRANSPARENT || lut[p] == IMAGE_TRANSPARENT) continue;
+
+            row[px] = lut[p];
+        }
+    }
 
-        GPU_BlitRect(data->texture, &srcRect, bufferTarget, &rect);
-    } else {
-        rect.w = data->width;
-        rect.h = data->height;
+    screenMarkDirty(x0, y0, x1, y1);
+}
+
+static double optNumber(lua_State *L, int tbl, const char *name, double def) {
+    lua_getfield(L, tbl, name);
+    double v = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : def;
+    lua_pop(L, 1);
+    return v;
+}
+
+static bool optBool(lua_State *L, int tbl, const char *name) {
+    lua_getfield(L, tbl, name);
+    bool v = lua_toboolean(L, -1) != 0;
+    lua_pop(L, 1);
+    return v;
+}
 
-        GPU_BlitRect(data->texture, NULL, bufferTarget, &rect);
+// image:renderEx(x, y[, {sx, sy, rotation, originX, originY, flipX, flipY, srcRect}])
+// sx/sy are scale factors, rotation is in degrees clockwise around the origin,
+// which is given in source pixels and lands on (x, y). srcRect is {x, y, w, h}.
+static int renderImageEx(lua_State *L) {
+    imageType *data = checkImage(L);
+    if (!freeCheck(L, data) || !targetCheck(L, data)) return 0;
+
+    double x = luaL_checknumber(L, 2) - drawOffX;
+    double y = luaL_checknumber(L, 3) - drawOffY;
+
+    renderExOpts o = { 1, 1, 0, 0, 0, false, false };
+    int sx = 0, sy = 0, w = data->width, h = data->height;
+
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+
+        o.scaleX = optNumber(L, 4, "sx", 1);
+        o.scaleY = optNumber(L, 4, "sy", 1);
+        o.rotation = optNumber(L, 4, "rotation", 0);
+        o.originX = optNumber(L, 4, "originX", 0);
+        o.originY = optNumber(L, 4, "originY", 0);
+        o.flipX = optBool(L, 4, "flipX");
+        o.flipY = optBool(L, 4, "flipY");
+
+        lua_getfield(L, 4, "srcRect");
+        if (lua_istable(L, -1)) {
+            int rect[4] = { 0, 0, data->width, data->height };
+            for (int i = 0; i < 4; i++) {
+                lua_rawgeti(L, -1, i + 1);
+                if (lua_isnumber(L, -1)) rect[i] = (int)lua_tointeger(L, -1);
+                lua_pop(L, 1);
+            }
+
+            // Keep the rect inside the image so sampling never leaves it
+            sx = clamp(rect[0], 0, data->width);
+            sy = clamp(rect[1], 0, data->height);
+            w = clamp(rect[2], 0, data->width - sx);
+            h = clamp(rect[3], 0, data->height - sy);
+        }
+        lua_pop(L, 1);
     }
 
+    compositeImageEx(data, x, y, sx, sy, w, h, &o);
+
     return 0;
 }
 
@@ -197,26 +613,154 @@ static int freeImage(lua_State *L) {
     imageType *data = checkImage(L);
     if (!freeCheck(L, data)) return 0;
 
-    for (int i = 0; i < data->width; i++) {
-        free(data->internalRep[i]);
+    // Drawing can't go on into a block that is about to be recycled
+    if (currentTarget.pixels == data->pixels) {
+        resetDrawTarget(L);
     }
-    free(data->internalRep);
 
-    SDL_FreeSurface(data->surface);
-    GPU_FreeImage(data->texture);
+    freePixels(data->pixels, data->capacity, data->scratch);
+    data->pixels = NULL;
+
     data->free = true;
 
     return 0;
 }
 
-static void internalDrawPixel(imageType *data, int x, int y, char c) {
+// Images freed explicitly are collected later, which must not raise
+static int gcImage(lua_State *L) {
+    imageType *data = checkImage(L);
+    if (data->free) return 0;
+
+    return freeImage(L);
+}
+
+static void internalDrawPixel(imageType *data, int x, int y, uint8_t c) {
     if (x >= 0 && y >= 0 && x < data->width && y < data->height) {
-        data->internalRep[x][y] = c;
+        data->pixels[y * data->pitch + x] = c;
+    }
+}
+
+static void internalFillRect(imageType *data, int x, int y, int w, int h, uint8_t c) {
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + w > data->width ? data->width : x + w;
+    int y1 = y + h > data->height ? data->height : y + h;
+
+    if (x1 <= x0 || y1 <= y0) return;
+
+    for (int yp = y0; yp < y1; yp++) {
+        memset(data->pixels + yp * data->pitch + x0, c, x1 - x0);
+    }
+}
+
+typedef struct {
+    imageType *image;
+    uint8_t color;
+} imageSpanCtx;
+
+static void imageSpan(void *ctx, int x, int y, int w, int h) {
+    imageSpanCtx *c = (imageSpanCtx *)ctx;
+    internalFillRect(c->image, x, y, w, h, c->color);
+}
+
+static rasterTarget imageTarget(imageSpanCtx *ctx) {
+    rasterTarget t;
+    t.span = imageSpan;
+    t.ctx = ctx;
+    t.top = 0;
+    t.bottom = ctx->image->height;
+    return t;
+}
+
+// Checks the Image and color for a shape method, false when there is nothing to draw
+static bool shapeArgs(lua_State *L, int colorArg, imageSpanCtx *ctx) {
+    ctx->image = checkImage(L);
+    if (!freeCheck(L, ctx->image)) return false;
+
+    int color = getColor(L, colorArg);
+    ctx->color = (uint8_t)color;
+    return color >= 0;
+}
+
+static int imageDrawLine(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 6, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    rasterLine(&t, luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+
+    return 0;
+}
+
+static int imageDrawCircle(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 5, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    rasterCircle(&t, luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+
+    return 0;
+}
+
+static int imageFillCircle(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 5, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    rasterFillCircle(&t, luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4));
+
+    return 0;
+}
+
+static int imageDrawEllipse(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 6, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    rasterEllipse(&t, luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+
+    return 0;
+}
+
+static int imageFillEllipse(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 6, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    rasterFillEllipse(&t, luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+
+    return 0;
+}
+
+static int imageFillPolygon(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 3, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    int n;
+    const double *xy = checkPolygon(L, 2, &n);
+    rasterFillPolygon(&t, xy, n);
+
+    return 0;
+}
+
+static int imageFillTriangle(lua_State *L) {
+    imageSpanCtx ctx;
+    if (!shapeArgs(L, 8, &ctx)) return 0;
+    rasterTarget t = imageTarget(&ctx);
+
+    double xy[6];
+    for (int i = 0; i < 6; i++) {
+        xy[i] = luaL_checknumber(L, i + 2);
     }
+    rasterFillPolygon(&t, xy, 3);
+
+    return 0;
 }
 
 static int imageGetPixel(lua_State *L) {
     imageType *data = checkImage(L);
+    if (!freeCheck(L, data)) return 0;
 
     int x = luaL_checkint(L, 2);
     int y = luaL_checkint(L, 3);
@@ -224,7 +768,8 @@ static int imageGetPixel(lua_State *L) {
     if (x < data->width && x >= 0
         && y < data->height && y >= 0) {
 
-        lua_pushinteger(L, data->internalRep[x][y] + 1);
+        uint8_t c = data->pixels[y * data->pitch + x];
+        lua_pushinteger(L, c == IMAGE_TRANSPARENT ? 0 : c + 1);
     } else {
         lua_pushinteger(L, 0);
     }
@@ -239,7 +784,6 @@ static int imageRemap(lua_State *L) {
     int newColor = getColor(L, 3);
 
     data->remap[oldColor] = newColor;
-    data->remapped = true;
 
     return 1;
 }
@@ -254,9 +798,6 @@ static int imageDrawPixel(lua_State *L) {
     int color = getColor(L, 4);
 
     if (color >= 0) {
-        Uint32 rectcolor = getRectC(data, color);
-        SDL_Rect rect = { x, y, 1, 1 };
-        SDL_FillRect(data->surface, &rect, rectcolor);
         internalDrawPixel(data, x, y, color);
     }
     return 0;
@@ -274,18 +815,56 @@ static int imageDrawRectangle(lua_State *L) {
     int color = getColor(L, 6);
 
     if (color >= 0) {
-        Uint32 rectcolor = getRectC(data, color);
-        SDL_Rect rect = { x, y, w, h };
-        SDL_FillRect(data->surface, &rect, rectcolor);
-        for (int xp = x; xp < x + w; xp++) {
-            for (int yp = y; yp < y + h; yp++) {
-                internalDrawPixel(data, xp, yp, color);
-            }
+        internalFillRect(data, x, y, w, h, (uint8_t)color);
+    }
+    return 0;
+}
+
+// image:drawRectangles(rects[, count]) and image:drawPixels(pixels[, count])
+// take the same flat batches as gpu.drawRectangles and gpu.drawPixels
+static int imageDrawRectangles(lua_State *L) {
+    imageType *data = checkImage(L);
+    if (!freeCheck(L, data)) return 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int count = lua_isnoneornil(L, 3) ? (int)lua_objlen(L, 2) / 5 : luaL_checkint(L, 3);
+
+    for (int i = 0; i < count; i++) {
+        int base = i * 5;
+        int x = batchValue(L, 2, base + 1);
+        int y = batchValue(L, 2, base + 2);
+        int w = batchValue(L, 2, base + 3);
+        int h = batchValue(L, 2, base + 4);
+        int color = toImageColor(batchValue(L, 2, base + 5));
+
+        if (color >= 0) {
+            internalFillRect(data, x, y, w, h, (uint8_t)color);
         }
     }
+
     return 0;
 }
 
+static int imageDrawPixels(lua_State *L) {
+    imageType *data = checkImage(L);
+    if (!freeCheck(L, data)) return 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int count = lua_isnoneornil(L, 3) ? (int)lua_objlen(L, 2) / 3 : luaL_checkint(L, 3);
+
+    for (int i = 0; i < count; i++) {
+        int base = i * 3;
+        int x = batchValue(L, 2, base + 1);
+        int y = batchValue(L, 2, base + 2);
+        int color = toImageColor(batchValue(L, 2, base + 3));
+
+        if (color >= 0) {
+            internalDrawPixel(data, x, y, (uint8_t)color);
+        }
+    }
+
+    return 0;
+}
 
 static int imageBlitPixels(lua_State *L) {
     imageType *data = checkImage(L);
@@ -295,8 +874,32 @@ static int imageBlitPixels(lua_State *L) {
     int y = luaL_checkint(L, 3);
     int w = luaL_checkint(L, 4);
     int h = luaL_checkint(L, 5);
+    int stride = luaL_optint(L, 7, w);
+
+    const uint8_t *bytes = checkPixelBytes(L, 6, w, h, stride);
+    if (bytes != NULL) {
+        int x0 = x < 0 ? -x : 0;
+        int y0 = y < 0 ? -y : 0;
+        int x1 = x + w > data->width ? data->width - x : w;
+        int y1 = y + h > data->height ? data->height - y : h;
+
+        for (int yp = y0; yp < y1; yp++) {
+            const uint8_t *src = bytes + (size_t)yp * stride;
+            uint8_t *dst = data->pixels + (y + yp) * data->pitch + x;
+            for (int xp = x0; xp < x1; xp++) {
+                int color = src[xp];
+                if (color == 0) continue;
+
+                dst[xp] = (uint8_t)(color > 16 ? 15 : color - 1);
+            }
+        }
+
+        return 0;
+    }
 
-    unsigned long long amt = lua_objlen(L, -1);
+    luaL_checktype(L, 6, LUA_TTABLE);
+
+    unsigned long long amt = lua_objlen(L, 6);
     int len = (int)w*(int)h;
     if (amt < len) {
         luaL_error(L, "blitPixels expected %d pixels, got %d", len, amt);
@@ -304,12 +907,13 @@ static int imageBlitPixels(lua_State *L) {
     }
 
     for (int i = 1; i <= len; i++) {
-        lua_pushnumber(L, i);
-        lua_gettable(L, -2);
+        lua_rawgeti(L, 6, i);
         if (!lua_isnumber(L, -1)) {
             luaL_error(L, "Index %d is non-numeric", i);
         }
         int color = (int)lua_tointeger(L, -1) - 1;
+        lua_pop(L, 1);
+
         if (color == -1) {
             continue;
         }
@@ -320,79 +924,318 @@ static int imageBlitPixels(lua_State *L) {
             int xp = ((i - 1) % (int)w);
             int yp = ((int)((i - 1) / (int)w));
 
-            Uint32 rectcolor = getRectC(data, color);
-            SDL_Rect rect = { x + xp, y + yp, 1, 1 };
-            SDL_FillRect(data->surface, &rect, rectcolor);
             internalDrawPixel(data, x + xp, y + yp, color);
         }
+    }
 
-        lua_pop(L, 1);
+    return 0;
+}
+
+static int imageDrawText(lua_State *L) {
+    imageType *data = checkImage(L);
+    if (!freeCheck(L, data)) return 0;
+
+    size_t len;
+    const char *str = luaL_checklstring(L, 2, &len);
+    int x = luaL_checkint(L, 3);
+    int y = luaL_checkint(L, 4);
+    int fg = getColor(L, 5);
+    int bg = lua_isnoneornil(L, 6) ? -1 : getColor(L, 6);
+
+    fontType *font = currentFont;
+    if (font == NULL) {
+        return luaL_error(L, "No font has been set, use gpu.setFont");
+    }
+
+    int w = font->width;
+    int h = font->height;
+
+    for (size_t i = 0; i < len; i++, x += w + 1) {
+        if (bg >= 0) {
+            internalFillRect(data, x, y, w + 1, h + 1, (uint8_t)bg);
+        }
+
+        int c = (uint8_t)str[i];
+        if (fg < 0 || c < font->rangeLow || c > font->rangeHigh) continue;
+
+        const uint8_t *glyph = font->glyphs + (c - font->rangeLow) * w * h;
+        for (int gy = 0; gy < h; gy++) {
+            for (int gx = 0; gx < w; gx++) {
+                if (glyph[gy * w + gx]) internalDrawPixel(data, x + gx, y + gy, (uint8_t)fg);
+            }
+        }
     }
 
     return 0;
 }
 
+// image:clear([x, y, w, h]) makes the whole image, or just the given region, transparent
 static int imageClear(lua_State *L) {
     imageType *data = checkImage(L);
     if (!freeCheck(L, data)) return 0;
 
-    int rectcolor = SDL_MapRGBA(data->surface->format, 0, 0, 0, 0);
-    SDL_FillRect(data->surface, NULL, rectcolor);
-    for (int xp = 0; xp < data->width; xp++) {
-        for (int yp = 0; yp < data->height; yp++) {
-            internalDrawPixel(data, xp, yp, 0);
-        }
+    if (lua_gettop(L) > 1) {
+        internalFillRect(data, luaL_checkint(L, 2), luaL_checkint(L, 3),
+                         luaL_checkint(L, 4), luaL_checkint(L, 5), IMAGE_TRANSPARENT);
+    } else {
+        memset(data->pixels, IMAGE_TRANSPARENT, (size_t)data->pitch * data->height);
     }
 
     return 0;
 }
 
+// Blits the w x h region at (sx, sy) of src to (x, y) of a destination buffer,
+// clipped to the source and to [cx0, cx1) x [cy0, cy1) of the destination.
+// Destination column i reads source column sx + i, or sx + w - 1 - i when
+// flipped, so the clip is the range of i that stays inside both. Returns false
+// when nothing is drawn, otherwise the touched rect is stored in bounds.
+static bool blitRegion(uint8_t *dst, int dstPitch, int cx0, int cy0, int cx1, int cy1,
+                       imageType *src, int x, int y, int sx, int sy, int w, int h,
+                       bool flipX, bool flipY, const uint8_t lut[16], int bounds[4]) {
+    int i0 = 0, i1 = w, j0 = 0, j1 = h;
+    if (cx0 - x > i0) i0 = cx0 - x;
+    if (cx1 - x < i1) i1 = cx1 - x;
+    if (cy0 - y > j0) j0 = cy0 - y;
+    if (cy1 - y < j1) j1 = cy1 - y;
+
+    int lo = flipX ? w - src->width + sx : -sx;
+    int hi = flipX ? w + sx : src->width - sx;
+    if (lo > i0) i0 = lo;
+    if (hi < i1) i1 = hi;
+
+    lo = flipY ? h - src->height + sy : -sy;
+    hi = flipY ? h + sy : src->height - sy;
+    if (lo > j0) j0 = lo;
+    if (hi < j1) j1 = hi;
+
+    if (i1 <= i0 || j1 <= j0) return false;
+
+    int n = i1 - i0;
+    int firstCol = flipX ? sx + w - i1 : sx + i0;
+    int firstRow = flipY ? sy + h - j1 : sy + j0;
+    const uint8_t *base = src->pixels + firstRow * src->pitch + firstCol;
+    int srcPitch = src->pitch;
+
+    // Stage the whole source region when blitting an image into itself, so
+    // overlapping rows are never read after they've been written
+    uint8_t *staged = NULL;
+    if (dst == src->pixels) {
+        int rows = j1 - j0;
+        staged = (uint8_t *)malloc((size_t)n * rows);
+        for (int r = 0; r < rows; r++) {
+            memcpy(staged + r * n, base + r * src->pitch, n);
+        }
+        base = staged;
+        srcPitch = n;
+    }
+
+    uint8_t reversedStack[SCRN_WIDTH];
+    uint8_t *reversed = NULL;
+    if (flipX) {
+        reversed = n <= SCRN_WIDTH ? reversedStack : (uint8_t *)malloc(n);
+    }
+
+    for (int j = j0; j < j1; j++) {
+        int row = flipY ? sy + h - 1 - j : sy + j;
+        const uint8_t *srcRow = base + (row - firstRow) * srcPitch;
+        uint8_t *dstRow = dst + (y + j) * dstPitch + x + i0;
+
+        if (flipX) {
+            for (int i = 0; i < n; i++) {
+                reversed[i] = srcRow[n - 1 - i];
+            }
+            srcRow = reversed;
+        }
+
+        blitIndexedRow(dstRow, srcRow, n, lut);
+    }
+
+    if (reversed != reversedStack) free(reversed);
+    free(staged);
+
+    bounds[0] = x + i0;
+    bounds[1] = y + j0;
+    bounds[2] = x + i1;
+    bounds[3] = y + j1;
+    return true;
+}
+
+// src:copy(dst, x, y[, w, h, sx, sy[, flipX, flipY[, transparent]]]) blits a
+// region of src into dst through src's remap table. transparent optionally
+// names a source color to skip on top of the transparent pixels.
 static int imageCopy(lua_State *L) {
     imageType *src = checkImage(L);
+    if (!freeCheck(L, src)) return 0;
 
     void *ud = luaL_checkudata(L, 2, "Riko4.Image");
     luaL_argcheck(L, ud != NULL, 1, "`Image` expected");
     imageType *dst = (imageType *)ud;
+    if (!freeCheck(L, dst)) return 0;
 
     int x = luaL_checkint(L, 3);
     int y = luaL_checkint(L, 4);
-    int wi;
-    int he;
 
-    SDL_Rect srcRect;
+    int sx = 0;
+    int sy = 0;
+    int w = src->width;
+    int h = src->height;
 
     if (lua_gettop(L) > 4) {
-        wi = luaL_checkint(L, 5);
-        he = luaL_checkint(L, 6);
-        //srcRect = { luaL_checkint(L, 7), luaL_checkint(L, 8), wi, he };
-        srcRect.x = luaL_checkint(L, 7);
-        srcRect.y = luaL_checkint(L, 8);
-        srcRect.w = wi;
-        srcRect.h = he;
-    } else {
-        //srcRect = { 0, 0, src->width, src->height };
-        srcRect.x = 0;
-        srcRect.y = 0;
-        srcRect.w = src->width;
-        srcRect.h = src->height;
-        wi = src->width;
-        he = src->height;
-    }
-
-    SDL_Rect rect = {x, y, wi, he};
-    SDL_BlitSurface(src->surface, &srcRect, dst->surface, &rect);
-    for (int xp = srcRect.x; xp < srcRect.x + srcRect.w; xp++) {
-        for (int yp = srcRect.y; yp < srcRect.y + srcRect.h; yp++) {
-            if (xp >= src->width || xp < 0 || yp >= src->height || yp < 0) {
-                continue;
-            }
-            internalDrawPixel(dst, xp, yp, src->internalRep[xp][yp]);
+        w = luaL_checkint(L, 5);
+        h = luaL_checkint(L, 6);
+        sx = luaL_checkint(L, 7);
+        sy = luaL_checkint(L, 8);
+    }
+
+    bool flipX = lua_toboolean(L, 9) != 0;
+    bool flipY = lua_toboolean(L, 10) != 0;
+
+    uint8_t lut[16];
+    buildLut(src, lut);
+    if (!lua_isnoneornil(L, 11)) {
+        int key = getColor(L, 11);
+        if (key >= 0) lut[key] = IMAGE_TRANSPARENT;
+    }
+
+    int bounds[4];
+    blitRegion(dst->pixels, dst->pitch, 0, 0, dst->width, dst->height,
+               src, x, y, sx, sy, w, h, flipX, flipY, lut, bounds);
+
+    return 0;
+}
+
+typedef struct {
+    imageType *image;
+    int imageRef;
+    int cellW;
+    int cellH;
+    int margin;
+    int spacing;
+    int columns;
+    int rows;
+} spriteSheetType;
+
+#define SPRITE_FLIP_X 1
+#define SPRITE_FLIP_Y 2
+
+static spriteSheetType *checkSpriteSheet(lua_State *L) {
+    void *ud = luaL_checkudata(L, 1, "Riko4.SpriteSheet");
+    luaL_argcheck(L, ud != NULL, 1, "`SpriteSheet` expected");
+    return (spriteSheetType *)ud;
+}
+
+// image.newSpriteSheet(image, cellW[, cellH[, margin[, spacing]]]), sprites are
+// numbered from 1 left to right, top to bottom
+static int newSpriteSheet(lua_State *L) {
+    imageType *img = checkImage(L);
+    if (!freeCheck(L, img)) return 0;
+
+    int cellW = luaL_checkint(L, 2);
+    int cellH = luaL_optint(L, 3, cellW);
+    int margin = luaL_optint(L, 4, 0);
+    int spacing = luaL_optint(L, 5, 0);
+
+    luaL_argcheck(L, cellW > 0, 2, "cell width must be positive");
+    luaL_argcheck(L, cellH > 0, 3, "cell height must be positive");
+
+    spriteSheetType *sheet = (spriteSheetType *)lua_newuserdata(L, sizeof(spriteSheetType));
+    sheet->image = img;
+    sheet->cellW = cellW;
+    sheet->cellH = cellH;
+    sheet->margin = margin;
+    sheet->spacing = spacing;
+    sheet->columns = (img->width - margin * 2 + spacing) / (cellW + spacing);
+    sheet->rows = (img->height - margin * 2 + spacing) / (cellH + spacing);
+    if (sheet->columns < 0) sheet->columns = 0;
+    if (sheet->rows < 0) sheet->rows = 0;
+
+    // The sheet keeps its image alive
+    lua_pushvalue(L, 1);
+    sheet->imageRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_getmetatable(L, "Riko4.SpriteSheet");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int spriteSheetGC(lua_State *L) {
+    spriteSheetType *sheet = checkSpriteSheet(L);
+    luaL_unref(L, LUA_REGISTRYINDEX, sheet->imageRef);
+    sheet->imageRef = LUA_NOREF;
+
+    return 0;
+}
+
+static void drawSprite(spriteSheetType *sheet, int id, int x, int y, int flip, const uint8_t lut[16]) {
+    if (id < 1 || id > sheet->columns * sheet->rows) return;
+
+    int sx = sheet->margin + ((id - 1) % sheet->columns) * (sheet->cellW + sheet->spacing);
+    int sy = sheet->margin + ((id - 1) / sheet->columns) * (sheet->cellH + sheet->spacing);
+
+    int bounds[4];
+    if (blitRegion(currentTarget.pixels, currentTarget.pitch, clipX, clipY, clipX + clipW, clipY + clipH,
+                   sheet->image, x - drawOffX, y - drawOffY, sx, sy, sheet->cellW, sheet->cellH,
+                   (flip & SPRITE_FLIP_X) != 0, (flip & SPRITE_FLIP_Y) != 0, lut, bounds)) {
+        screenMarkDirty(bounds[0], bounds[1], bounds[2], bounds[3]);
+    }
+}
+
+// sheet:draw(id, x, y[, flip]), flip is 1 for horizontal, 2 for vertical, 3 for both
+static int spriteSheetDraw(lua_State *L) {
+    spriteSheetType *sheet = checkSpriteSheet(L);
+    if (!freeCheck(L, sheet->image) || !targetCheck(L, sheet->image)) return 0;
+
+    uint8_t lut[16];
+    buildLut(sheet->image, lut);
+
+    drawSprite(sheet, luaL_checkint(L, 2), luaL_checkint(L, 3), luaL_checkint(L, 4),
+               luaL_optint(L, 5, 0), lut);
+
+    return 0;
+}
+
+// sheet:drawMany(sprites[, count]) draws a flat list {id, x, y, flip, ...} in one call
+static int spriteSheetDrawMany(lua_State *L) {
+    spriteSheetType *sheet = checkSpriteSheet(L);
+    if (!freeCheck(L, sheet->image) || !targetCheck(L, sheet->image)) return 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int count = lua_isnoneornil(L, 3) ? (int)lua_objlen(L, 2) / 4 : luaL_checkint(L, 3);
+
+    uint8_t lut[16];
+    buildLut(sheet->image, lut);
+
+    for (int i = 0; i < count; i++) {
+        int base = i * 4;
+        int v[4];
+        for (int k = 0; k < 4; k++) {
+            lua_rawgeti(L, 2, base + k + 1);
+            v[k] = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
         }
+
+        drawSprite(sheet, v[0], v[1], v[2], v[3], lut);
     }
 
     return 0;
 }
 
+static int spriteSheetGetSize(lua_State *L) {
+    spriteSheetType *sheet = checkSpriteSheet(L);
+
+    lua_pushinteger(L, sheet->columns);
+    lua_pushinteger(L, sheet->rows);
+    return 2;
+}
+
+static int spriteSheetGetImage(lua_State *L) {
+    spriteSheetType *sheet = checkSpriteSheet(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sheet->imageRef);
+    return 1;
+}
+
 static int imageToString(lua_State *L) {
     imageType *data = checkImage(L);
     if (data->free) {
@@ -419,6 +1262,11 @@ static int imageGetHeight(lua_State *L) {
 
 static const luaL_Reg imageLib[] = {
     { "newImage", newImage },
+    { "newScratch", newScratch },
+    { "getPoolStats", getPoolStats },
+    { "newSpriteSheet", newSpriteSheet },
+    { "decodeRIF", imageDecodeRIF },
+    { "loadRIF", imageLoadRIF },
     { NULL, NULL }
 };
 
@@ -427,26 +1275,58 @@ static const luaL_Reg imageLib_m[] = {
     { "free", freeImage },
     { "flush", flushImage },
     { "render", renderImage },
+    { "renderEx", renderImageEx },
     { "clear", imageClear },
     { "drawPixel", imageDrawPixel },
     { "drawRectangle", imageDrawRectangle },
+    { "drawPixels", imageDrawPixels },
+    { "drawRectangles", imageDrawRectangles },
+    { "drawLine", imageDrawLine },
+    { "drawCircle", imageDrawCircle },
+    { "fillCircle", imageFillCircle },
+    { "drawEllipse", imageDrawEllipse },
+    { "fillEllipse", imageFillEllipse },
+    { "fillPolygon", imageFillPolygon },
+    { "fillTriangle", imageFillTriangle },
     { "blitPixels", imageBlitPixels },
+    { "drawText", imageDrawText },
     { "getPixel", imageGetPixel },
     { "remap", imageRemap },
     { "copy", imageCopy },
+    { "encodeRIF", imageEncodeRIF },
     { "getWidth", imageGetWidth },
     { "getHeight", imageGetHeight },
     { NULL, NULL }
 };
 
+static const luaL_Reg spriteSheetLib_m[] = {
+    { "draw", spriteSheetDraw },
+    { "drawMany", spriteSheetDrawMany },
+    { "getSize", spriteSheetGetSize },
+    { "getImage", spriteSheetGetImage },
+    { NULL, NULL }
+};
+
 LUALIB_API int luaopen_image(lua_State *L) {
+    luaL_newmetatable(L, "Riko4.SpriteSheet");
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, spriteSheetGC);
+    lua_settable(L, -3);
+
+    luaL_openlib(L, NULL, spriteSheetLib_m, 0);
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, "Riko4.Image");
 
     lua_pushstring(L, "__index");
     lua_pushvalue(L, -2);  /* pushes the metatable */
     lua_settable(L, -3);  /* metatable.__index = metatable */
     lua_pushstring(L, "__gc");
-    lua_pushcfunction(L, freeImage);
+    lua_pushcfunction(L, gcImage);
     lua_settable(L, -3);
 
     luaL_openlib(L, NULL, imageLib_m, 0);
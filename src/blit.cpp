@@ -0,0 +1,120 @@
+#include "blit.h"
+
+#include <SDL2/SDL.h>
+
+#if !defined(__EMSCRIPTEN__) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#  define RIKO_BLIT_X86
+#  include <immintrin.h>
+#  if defined(__GNUC__) || defined(__clang__)
+#    define RIKO_TARGET(t) __attribute__((target(t)))
+#  else
+#    define RIKO_TARGET(t)
+#  endif
+#endif
+
+typedef void (*blitRowFunc)(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]);
+
+static void blitRowScalar(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]) {
+    for (int i = 0; i < n; i++) {
+        uint8_t c = src[i];
+        if (c == IMAGE_TRANSPARENT) continue;
+
+        uint8_t v = lut[c & 15];
+        if (v != IMAGE_TRANSPARENT) dst[i] = v;
+    }
+}
+
+static bool isIdentity(const uint8_t lut[16]) {
+    for (int i = 0; i < 16; i++) {
+        if (lut[i] != i) return false;
+    }
+    return true;
+}
+
+#ifdef RIKO_BLIT_X86
+
+// SSE2 has no byte shuffle, so it only speeds up unremapped images (the common
+// case) with a masked blend and leaves remapped ones to the scalar loop
+RIKO_TARGET("sse2")
+static void blitRowSSE2(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]) {
+    if (!isIdentity(lut)) {
+        blitRowScalar(dst, src, n, lut);
+        return;
+    }
+
+    const __m128i transparent = _mm_set1_epi8((char)IMAGE_TRANSPARENT);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i mask = _mm_cmpeq_epi8(s, transparent);
+        __m128i out = _mm_or_si128(_mm_andnot_si128(mask, s), _mm_and_si128(mask, d));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+
+    blitRowScalar(dst + i, src + i, n - i, lut);
+}
+
+// pshufb does the 16 entry lookup directly. The transparent index has its high
+// bit set so it shuffles to 0, the blend mask covers both it and table entries
+// that map to IMAGE_TRANSPARENT.
+RIKO_TARGET("sse4.1")
+static void blitRowSSE41(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]) {
+    const __m128i table = _mm_loadu_si128((const __m128i *)lut);
+    const __m128i transparent = _mm_set1_epi8((char)IMAGE_TRANSPARENT);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i v = _mm_shuffle_epi8(table, s);
+        __m128i mask = _mm_or_si128(_mm_cmpeq_epi8(s, transparent), _mm_cmpeq_epi8(v, transparent));
+        __m128i out = _mm_blendv_epi8(v, d, mask);
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+
+    blitRowScalar(dst + i, src + i, n - i, lut);
+}
+
+RIKO_TARGET("avx2")
+static void blitRowAVX2(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]) {
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lut));
+    const __m256i transparent = _mm256_set1_epi8((char)IMAGE_TRANSPARENT);
+
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i v = _mm256_shuffle_epi8(table, s);
+        __m256i mask = _mm256_or_si256(_mm256_cmpeq_epi8(s, transparent), _mm256_cmpeq_epi8(v, transparent));
+        __m256i out = _mm256_blendv_epi8(v, d, mask);
+        _mm256_storeu_si256((__m256i *)(dst + i), out);
+    }
+
+    // Finish here rather than in the SSE4.1 kernel, mixing VEX and legacy SSE
+    // code stalls on the transition
+    for (; i < n; i++) {
+        uint8_t c = src[i];
+        if (c == IMAGE_TRANSPARENT) continue;
+
+        uint8_t v = lut[c & 15];
+        if (v != IMAGE_TRANSPARENT) dst[i] = v;
+    }
+}
+
+#endif
+
+static blitRowFunc pickBlitRow() {
+#ifdef RIKO_BLIT_X86
+    if (SDL_HasAVX2()) return blitRowAVX2;
+    if (SDL_HasSSE41()) return blitRowSSE41;
+    if (SDL_HasSSE2()) return blitRowSSE2;
+#endif
+    return blitRowScalar;
+}
+
+void blitIndexedRow(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]) {
+    static blitRowFunc blitRow = pickBlitRow();
+    blitRow(dst, src, n, lut);
+}
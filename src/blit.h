@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+#define IMAGE_TRANSPARENT 0xFF
+
+// Copies n palette indices from src to dst through a 16 entry lookup table,
+// skipping source pixels and table entries that are IMAGE_TRANSPARENT. Picks
+// an SSE2/SSE4.1/AVX2 kernel at runtime when the CPU has one.
+void blitIndexedRow(uint8_t *dst, const uint8_t *src, int n, const uint8_t lut[16]);
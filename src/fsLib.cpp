@@ -97,6 +97,13 @@ typedef struct {
     bool eof;
 } fileHandleType;
 
+// Resolves a script path into resolved (MAX_PATH + 1 bytes), raising a Lua
+// error when it points outside the fs sandbox
+int fsResolvePath(lua_State *L, const char *path, char *resolved) {
+    checkPath(path, resolved);
+    return 0;
+}
+
 static fileHandleType *checkFsObj(lua_State *L) {
     void *ud = luaL_checkudata(L, 1, "Riko4.fsObj");
     luaL_argcheck(L, ud != NULL, 1, "`FileHandle` expected");
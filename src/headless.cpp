@@ -0,0 +1,199 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "headless.h"
+
+#include "rikoConsts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+bool headless = false;
+
+int headlessFrameLimit = -1;
+bool headlessDumpAll = false;
+bool headlessDumpRaw = false;
+const char *headlessDumpDir = ".";
+
+static int *dumpFrames = NULL;
+static int dumpFrameCount = 0;
+
+static int frameCount = 0;
+
+// Parses a comma separated list of frame numbers, "all" dumps every frame
+void headlessAddDumpFrames(const char *list) {
+    if (!strcmp(list, "all")) {
+        headlessDumpAll = true;
+        return;
+    }
+
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long frame = strtol(p, &end, 10);
+        if (end == p) break;
+
+        dumpFrames = (int *)realloc(dumpFrames, (dumpFrameCount + 1) * sizeof(int));
+        dumpFrames[dumpFrameCount++] = (int)frame;
+
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+static bool shouldDump(int frame) {
+    if (headlessDumpAll) return true;
+
+    for (int i = 0; i < dumpFrameCount; i++) {
+        if (dumpFrames[i] == frame) return true;
+    }
+
+    return false;
+}
+
+static Uint32 crcTable[256];
+static bool crcTableReady = false;
+
+static Uint32 crc32(Uint32 crc, const uint8_t *data, size_t len) {
+    if (!crcTableReady) {
+        for (Uint32 n = 0; n < 256; n++) {
+            Uint32 c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crcTable[n] = c;
+        }
+        crcTableReady = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void putU32(uint8_t *out, Uint32 v) {
+    out[0] = (uint8_t)(v >> 24);
+    out[1] = (uint8_t)(v >> 16);
+    out[2] = (uint8_t)(v >> 8);
+    out[3] = (uint8_t)v;
+}
+
+static void writeChunk(FILE *f, const char *type, const uint8_t *data, Uint32 len) {
+    uint8_t header[8];
+    putU32(header, len);
+    memcpy(header + 4, type, 4);
+    fwrite(header, 1, 8, f);
+    if (len > 0) fwrite(data, 1, len, f);
+
+    uint8_t crc[4];
+    putU32(crc, crc32(crc32(0, header + 4, 4), data, len));
+    fwrite(crc, 1, 4, f);
+}
+
+// Writes a palette based PNG, the pixel data is zlib "stored" (uncompressed)
+// which keeps this tiny and the frames are small anyway
+bool writeIndexedPNG(const char *path, const uint8_t *indices, int w, int h, int palette[16][3]) {
+    size_t rawLen = (size_t)(w + 1) * h;
+    size_t blocks = (rawLen + 65534) / 65535;
+    size_t idatLen = 2 + rawLen + blocks * 5 + 4;
+    uint8_t *idat = (uint8_t *)malloc(idatLen);
+    uint8_t *raw = (uint8_t *)malloc(rawLen);
+
+    FILE *f = idat != NULL && raw != NULL ? fopen(path, "wb") : NULL;
+    if (f == NULL) {
+        free(raw);
+        free(idat);
+        return false;
+    }
+
+    static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    fwrite(signature, 1, 8, f);
+
+    uint8_t ihdr[13];
+    putU32(ihdr, (Uint32)w);
+    putU32(ihdr + 4, (Uint32)h);
+    ihdr[8] = 8;  // Bit depth
+    ihdr[9] = 3;  // Indexed color
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+    writeChunk(f, "IHDR", ihdr, 13);
+
+    uint8_t plte[16 * 3];
+    for (int i = 0; i < 16; i++) {
+        plte[i * 3] = (uint8_t)palette[i][0];
+        plte[i * 3 + 1] = (uint8_t)palette[i][1];
+        plte[i * 3 + 2] = (uint8_t)palette[i][2];
+    }
+    writeChunk(f, "PLTE", plte, sizeof(plte));
+
+    for (int y = 0; y < h; y++) {
+        raw[y * (w + 1)] = 0;  // No filter
+        memcpy(raw + y * (w + 1) + 1, indices + y * w, w);
+    }
+
+    size_t pos = 0;
+    idat[pos++] = 0x78;
+    idat[pos++] = 0x01;
+
+    Uint32 a = 1, b = 0;
+    for (size_t off = 0; off < rawLen; off += 65535) {
+        size_t len = rawLen - off > 65535 ? 65535 : rawLen - off;
+        idat[pos++] = off + len == rawLen ? 1 : 0;
+        idat[pos++] = (uint8_t)len;
+        idat[pos++] = (uint8_t)(len >> 8);
+        idat[pos++] = (uint8_t)~len;
+        idat[pos++] = (uint8_t)(~len >> 8);
+        memcpy(idat + pos, raw + off, len);
+        pos += len;
+
+        for (size_t i = off; i < off + len; i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    putU32(idat + pos, (b << 16) | a);
+    pos += 4;
+
+    writeChunk(f, "IDAT", idat, (Uint32)pos);
+    writeChunk(f, "IEND", NULL, 0);
+
+    free(raw);
+    free(idat);
+
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+// Stands in for presenting a frame when there is no window, dumps it if it
+// was asked for and ends the run once the frame limit is hit
+void headlessPresent(const uint8_t *indices, int palette[16][3]) {
+    frameCount++;
+
+    if (shouldDump(frameCount)) {
+        char path[MAX_PATH + 1];
+        snprintf(path, sizeof(path), "%s/frame_%05d.%s", headlessDumpDir, frameCount, headlessDumpRaw ? "raw" : "png");
+
+        bool ok;
+        if (headlessDumpRaw) {
+            FILE *f = fopen(path, "wb");
+            ok = f != NULL && fwrite(indices, 1, SCRN_WIDTH * SCRN_HEIGHT, f) == SCRN_WIDTH * SCRN_HEIGHT;
+            if (f != NULL) fclose(f);
+        } else {
+            ok = writeIndexedPNG(path, indices, SCRN_WIDTH, SCRN_HEIGHT, palette);
+        }
+
+        if (!ok) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write frame dump '%s'", path);
+        }
+    }
+
+    if (headlessFrameLimit >= 0 && frameCount >= headlessFrameLimit) {
+        printf("Reached frame limit (%d), exiting\n", headlessFrameLimit);
+        quitRiko(0);
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+extern bool headless;
+
+extern int headlessFrameLimit;
+extern bool headlessDumpAll;
+extern bool headlessDumpRaw;
+extern const char *headlessDumpDir;
+
+void headlessAddDumpFrames(const char *list);
+void headlessPresent(const uint8_t *indices, int palette[16][3]);
+
+bool writeIndexedPNG(const char *path, const uint8_t *indices, int w, int h, int palette[16][3]);
+
+// Provided by riko.cpp, tears everything down and exits the process
+void quitRiko(int code);
@@ -6,4 +6,9 @@
 #else
 #  include <LuaJIT/lua.hpp>
 #  include <LuaJIT/lauxlib.h>
-#endif
\ No newline at end of file
+#endif
+
+/* LuaJIT reports FFI cdata as this type, it is not exposed in lua.h */
+#ifndef LUA_TCDATA
+#  define LUA_TCDATA 10
+#endif
@@ -0,0 +1,265 @@
+#include "raster.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Spans are clamped this far out so x + w can never overflow in the targets
+#define RASTER_LIMIT (1 << 24)
+
+// Truncates toward zero like lua_tointeger, which the Lua versions went through
+static inline int rasterInt(double v) {
+    if (!(v > -RASTER_LIMIT)) return -RASTER_LIMIT;
+    if (v > RASTER_LIMIT) return RASTER_LIMIT;
+    return (int)v;
+}
+
+static inline void emitSpan(const rasterTarget *t, double x, double y, double w, double h) {
+    t->span(t->ctx, rasterInt(x), rasterInt(y), rasterInt(w), rasterInt(h));
+}
+
+static inline void emitPixel(const rasterTarget *t, double x, double y) {
+    t->span(t->ctx, rasterInt(x), rasterInt(y), 1, 1);
+}
+
+// gpp.lua's round, halves go up
+static inline double roundHalfUp(double n) {
+    double f = floor(n);
+    return n - f >= 0.5 ? ceil(n) : f;
+}
+
+// Bresenham, with each run of pixels on one row (or column for steep lines)
+// sent as a single span
+void rasterLine(const rasterTarget *t, double x1, double y1, double x2, double y2) {
+    double deltaX = x2 - x1;
+    double deltaY = y2 - y1;
+
+    if (fabs(deltaX) >= fabs(deltaY)) {
+        if (x1 > x2) {
+            double tx = x1, ty = y1;
+            x1 = x2; y1 = y2;
+            x2 = tx; y2 = ty;
+
+            deltaX = x2 - x1;
+            deltaY = y2 - y1;
+        }
+
+        double ddY = deltaY > 0 ? 1 : -1;
+        double deltaErr = 2 * deltaY * ddY - deltaX;
+
+        double y = y1;
+        double start = x1;
+        for (double x = x1; x <= x2; x++) {
+            if (deltaErr > 0) {
+                emitSpan(t, start, y, x - start + 1, 1);
+                start = x + 1;
+                y += ddY;
+                deltaErr -= deltaX;
+            }
+            deltaErr += deltaY * ddY;
+        }
+        if (start <= x2) emitSpan(t, start, y, x2 - start + 1, 1);
+    } else {
+        if (y1 > y2) {
+            double tx = x1, ty = y1;
+            x1 = x2; y1 = y2;
+            x2 = tx; y2 = ty;
+
+            deltaX = x2 - x1;
+            deltaY = y2 - y1;
+        }
+
+        double ddX = deltaX > 0 ? 1 : -1;
+        double deltaErr = 2 * deltaX * ddX - deltaY;
+
+        double x = x1;
+        double start = y1;
+        for (double y = y1; y <= y2; y++) {
+            if (deltaErr > 0) {
+                emitSpan(t, x, start, 1, y - start + 1);
+                start = y + 1;
+                x += ddX;
+                deltaErr -= deltaY;
+            }
+            deltaErr += deltaX * ddX;
+        }
+        if (start <= y2) emitSpan(t, x, start, 1, y2 - start + 1);
+    }
+}
+
+// Midpoint circle, stepping exactly like rasterFillCircle so an outline
+// traces the edge of the filled version
+void rasterCircle(const rasterTarget *t, double x0, double y0, double r) {
+    double x = r;
+    double y = 0;
+    double err = 0;
+
+    while (x >= y) {
+        emitPixel(t, x0 + x, y0 + y);
+        emitPixel(t, x0 - x, y0 + y);
+        emitPixel(t, x0 + x, y0 - y);
+        emitPixel(t, x0 - x, y0 - y);
+        emitPixel(t, x0 + y, y0 + x);
+        emitPixel(t, x0 - y, y0 + x);
+        emitPixel(t, x0 + y, y0 - x);
+        emitPixel(t, x0 - y, y0 - x);
+
+        y++;
+        if (err <= 0) {
+            err += 2 * y + 1;
+        } else {
+            x--;
+            err += 2 * (y - x) + 1;
+        }
+    }
+}
+
+void rasterFillCircle(const rasterTarget *t, double x0, double y0, double r) {
+    double x = r;
+    double y = 0;
+    double err = 0;
+
+    while (x >= y) {
+        emitSpan(t, x0 - x, y0 + y, 2 * x + 1, 1);
+        emitSpan(t, x0 - y, y0 + x, 2 * y + 1, 1);
+
+        emitSpan(t, x0 - x, y0 - y, 2 * x + 1, 1);
+        emitSpan(t, x0 - y, y0 - x, 2 * y + 1, 1);
+
+        y++;
+        if (err <= 0) {
+            err += 2 * y + 1;
+        } else {
+            x--;
+            err += 2 * (y - x) + 1;
+        }
+    }
+}
+
+static inline void ellipseStep(const rasterTarget *t, double x0, double y0, double x, double y, bool fill) {
+    if (fill) {
+        emitSpan(t, x0 - x, y0 + y, 2 * x + 1, 1);
+        emitSpan(t, x0 - x, y0 - y, 2 * x + 1, 1);
+    } else {
+        emitPixel(t, x0 + x, y0 + y);
+        emitPixel(t, x0 - x, y0 + y);
+        emitPixel(t, x0 - x, y0 - y);
+        emitPixel(t, x0 + x, y0 - y);
+    }
+}
+
+// Two region midpoint ellipse, the first region steps y and the second x
+static void ellipse(const rasterTarget *t, double x0, double y0, double rx, double ry, bool fill) {
+    double twoASquare = 2 * rx * rx;
+    double twoBSquare = 2 * ry * ry;
+    double x = rx;
+    double y = 0;
+    double dx = ry * ry * (1 - 2 * rx);
+    double dy = rx * rx;
+    double err = 0;
+    double stopX = twoBSquare * rx;
+    double stopY = 0;
+
+    while (stopX >= stopY) {
+        ellipseStep(t, x0, y0, x, y, fill);
+
+        y++;
+        stopY += twoASquare;
+        err += dy;
+        dy += twoASquare;
+
+        if (2 * err + dx > 0) {
+            x--;
+            stopX -= twoBSquare;
+            err += dx;
+            dx += twoBSquare;
+        }
+    }
+
+    x = 0;
+    y = ry;
+    dx = ry * ry;
+    dy = rx * rx * (1 - 2 * ry);
+    err = 0;
+    stopX = 0;
+    stopY = twoASquare * ry;
+
+    while (stopX <= stopY) {
+        ellipseStep(t, x0, y0, x, y, fill);
+
+        x++;
+        stopX += twoBSquare;
+        err += dx;
+        dx += twoBSquare;
+
+        if (2 * err + dy > 0) {
+            y--;
+            stopY -= twoASquare;
+            err += dy;
+            dy += twoASquare;
+        }
+    }
+}
+
+void rasterEllipse(const rasterTarget *t, double x0, double y0, double rx, double ry) {
+    ellipse(t, x0, y0, rx, ry, false);
+}
+
+void rasterFillEllipse(const rasterTarget *t, double x0, double y0, double rx, double ry) {
+    ellipse(t, x0, y0, rx, ry, true);
+}
+
+// Scanline fill, one row at a time from the topmost vertex. Each row collects
+// where the edges cross it, sorts the crossings and fills between pairs.
+void rasterFillPolygon(const rasterTarget *t, const double *xy, int n) {
+    if (n <= 0) return;
+
+    double top = xy[1];
+    double bot = xy[1];
+    for (int i = 1; i < n; i++) {
+        double y = xy[i * 2 + 1];
+        if (y < top) top = y;
+        if (y > bot) bot = y;
+    }
+
+    double stackNodes[64];
+    double *nodeX = n <= 64 ? stackNodes : (double *)malloc(n * sizeof(double));
+    if (nodeX == NULL) return;
+
+    // Rows keep the fractional offset of the top vertex, so start on the
+    // first one that can land inside the target
+    double pixelY = top;
+    if (top < t->top - 1) pixelY += floor(t->top - 1 - top);
+
+    for (; pixelY <= bot; pixelY++) {
+        int row = rasterInt(pixelY);
+        if (row >= t->bottom) break;
+        if (row < t->top) continue;
+
+        int nodes = 0;
+        for (int i = 0, j = n - 1; i < n; j = i++) {
+            double px = xy[i * 2], py = xy[i * 2 + 1];
+            double nx = xy[j * 2], ny = xy[j * 2 + 1];
+
+            if ((py < pixelY && ny >= pixelY) || (ny < pixelY && py >= pixelY)) {
+                double node = roundHalfUp(px + (pixelY - py) / (ny - py) * (nx - px));
+                nodeX[nodes++] = node < -RASTER_LIMIT ? -RASTER_LIMIT : (node > RASTER_LIMIT ? RASTER_LIMIT : node);
+            }
+        }
+
+        for (int i = 1; i < nodes; i++) {
+            double v = nodeX[i];
+            int k = i - 1;
+            while (k >= 0 && nodeX[k] > v) {
+                nodeX[k + 1] = nodeX[k];
+                k--;
+            }
+            nodeX[k + 1] = v;
+        }
+
+        for (int i = 0; i + 1 < nodes; i += 2) {
+            emitSpan(t, nodeX[i], pixelY, nodeX[i + 1] - nodeX[i] + 1, 1);
+        }
+    }
+
+    if (nodeX != stackNodes) free(nodeX);
+}
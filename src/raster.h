@@ -0,0 +1,25 @@
+#pragma once
+
+// Receives the spans a shape is made of. The target clips them, w or h may be
+// negative for degenerate shapes and mean a flipped span, as in drawRectangle.
+typedef void (*rasterSpanFunc)(void *ctx, int x, int y, int w, int h);
+
+typedef struct {
+    rasterSpanFunc span;
+    void *ctx;
+    // Rows in [top, bottom) that can be visible, scanline fills skip the rest
+    int top;
+    int bottom;
+} rasterTarget;
+
+// Ports of the scripts/lib/gpp.lua algorithms. Coordinates are doubles so
+// fractional arguments give the same pixels as the Lua versions, which
+// truncate each span when it reaches drawRectangle.
+void rasterLine(const rasterTarget *t, double x1, double y1, double x2, double y2);
+void rasterCircle(const rasterTarget *t, double x0, double y0, double r);
+void rasterFillCircle(const rasterTarget *t, double x0, double y0, double r);
+void rasterEllipse(const rasterTarget *t, double x0, double y0, double rx, double ry);
+void rasterFillEllipse(const rasterTarget *t, double x0, double y0, double rx, double ry);
+
+// xy holds n vertices as x, y pairs, filled with the even-odd rule
+void rasterFillPolygon(const rasterTarget *t, const double *xy, int n);
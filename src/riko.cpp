@@ -50,10 +50,10 @@
 #include "rikoAudio.h"
 #include "rikoImage.h"
 #include "shader.h"
+#include "headless.h"
 
 GPU_Image *buffer;
 GPU_Target *renderer;
-GPU_Target *bufferTarget;
 
 lua_State *mainThread;
 
@@ -64,6 +64,7 @@ int pixelSize = 5;
 int afPixscale = 5;
 
 bool audEnabled = true;
+int audVoices = 32;
 bool shaderOn = true;
 
 void printLuaError(int result) {
@@ -310,6 +311,8 @@ int exitCode = 0;
 
 bool readyForProp = true;
 
+extern bool forcePresent;
+
 bool ctrlMod = false;
 bool holdR = false;
 clock_t holdL = 0;
@@ -443,6 +446,14 @@ void loop() {
                 lua_pushnumber(mainThread, event.jball.which);
                 pushedArgs = 4;
                 break;
+            case SDL_WINDOWEVENT:
+                // The window contents may be gone, so present on the next swap even if the screen didn't change
+                if (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_RESIZED ||
+                    event.window.event == SDL_WINDOWEVENT_RESTORED) {
+                    forcePresent = true;
+                }
+                readyForProp = false;
+                break;
             default:
                 readyForProp = false;
             }
@@ -462,6 +473,11 @@ void loop() {
                     exitCode = 1;
                 }
             }
+
+            // Nothing can revive a finished script without a window to interact with
+            if (headless && !canRun) {
+                running = false;
+            }
             break;
         }
 
@@ -496,14 +512,75 @@ void loop() {
     }
 }
 
+void cleanup() {
+    SDL_free(appPath);
+
+    closeAudio();
+
+    if (!headless) {
+        GPU_FreeTarget(renderer);
+
+        GPU_Quit();
+    }
+    SDL_Quit();
+}
+
+void quitRiko(int code) {
+    cleanup();
+    exit(code);
+}
+
+// Types a command into the shell, used by --run in headless mode
+void pushCommand(const char *command) {
+    SDL_Event ev;
+
+    for (const char *c = command; *c; c++) {
+        SDL_zero(ev);
+        ev.type = SDL_TEXTINPUT;
+        ev.text.text[0] = *c;
+        SDL_PushEvent(&ev);
+    }
+
+    SDL_zero(ev);
+    ev.type = SDL_KEYDOWN;
+    ev.key.keysym.sym = SDLK_RETURN;
+    ev.key.keysym.scancode = SDL_SCANCODE_RETURN;
+    SDL_PushEvent(&ev);
+}
+
 int main(int argc, char * argv[]) {
-    if (argc > 1) {
-        if (!strcmp("--noaud", argv[1])) {
+    const char *runCommand = NULL;
+    const char *audioFilePath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp("--noaud", argv[i])) {
             audEnabled = false;
+        } else if (!strcmp("--headless", argv[i])) {
+            headless = true;
+            audEnabled = false;
+        } else if (!strcmp("--frames", argv[i]) && i + 1 < argc) {
+            headlessFrameLimit = atoi(argv[++i]);
+        } else if (!strcmp("--dump-frames", argv[i]) && i + 1 < argc) {
+            headlessAddDumpFrames(argv[++i]);
+        } else if (!strcmp("--dump-format", argv[i]) && i + 1 < argc) {
+            headlessDumpRaw = !strcmp("raw", argv[++i]);
+        } else if (!strcmp("--dump-dir", argv[i]) && i + 1 < argc) {
+            headlessDumpDir = argv[++i];
+        } else if (!strcmp("--run", argv[i]) && i + 1 < argc) {
+            runCommand = argv[++i];
+        } else if (!strcmp("--audio-file", argv[i]) && i + 1 < argc) {
+            audioFilePath = argv[++i];
+            audEnabled = false;
+        } else {
+            printf("Unknown argument '%s'\n", argv[i]);
         }
     }
 
-    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER);
+    if (headless) {
+        SDL_Init(SDL_INIT_EVENTS);
+    } else {
+        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER);
+    }
 
     /* Open the first available controller. */
     SDL_GameController *controller = NULL;
@@ -549,6 +626,15 @@ int main(int argc, char * argv[]) {
         if (lua_type(configState, -1) == LUA_TBOOLEAN) {
             shaderOn = lua_toboolean(configState, -1);
         }
+        lua_pop(configState, 1);
+
+        lua_pushstring(configState, "voices");
+        lua_gettable(configState, -2);
+
+        if (lua_type(configState, -1) == LUA_TNUMBER) {
+            audVoices = lua_tointeger(configState, -1);
+        }
+        lua_pop(configState, 1);
     }
 
 #ifdef __EMSCRIPTEN__
@@ -591,6 +677,36 @@ int main(int argc, char * argv[]) {
 #endif
     }
 
+    char *bootLoc = (char*)malloc(sizeof(char)*(strlen(scriptsPath) + 10));
+    sprintf(bootLoc, "%s/boot.lua", scriptsPath);
+
+    if (audioFilePath != NULL && !audioFileOpen(audioFilePath)) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to open audio file '%s'", audioFilePath);
+        return 1;
+    }
+
+    if (headless) {
+        createLuaInstance(bootLoc);
+
+        if (fatalLoadError) {
+            return 7;
+        }
+
+        if (runCommand != NULL) {
+            // Let boot.lua get to the shell prompt before typing into it
+            loop();
+            pushCommand(runCommand);
+        }
+
+        while (running) {
+            loop();
+        }
+
+        cleanup();
+
+        return exitCode;
+    }
+
     SDL_DisplayMode current;
     int lw = INT_MAX;
     int lh = INT_MAX;
@@ -623,13 +739,12 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    buffer = GPU_CreateImage(SCRN_WIDTH, SCRN_HEIGHT, GPU_FORMAT_RGBA);
+    // One byte palette index per pixel, resolved to RGB by the screen shader
+    buffer = GPU_CreateImage(SCRN_WIDTH, SCRN_HEIGHT, GPU_FORMAT_LUMINANCE);
 
     GPU_SetBlending(buffer, GPU_FALSE);
     GPU_SetImageFilter(buffer, GPU_FILTER_NEAREST);
 
-    bufferTarget = GPU_LoadTarget(buffer);
-
     GPU_Clear(renderer);
     
     initShader();
@@ -645,8 +760,6 @@ int main(int argc, char * argv[]) {
 
     SDL_SetWindowTitle(window, "Riko4");
 
-    char *bootLoc = (char*)malloc(sizeof(char)*(strlen(scriptsPath) + 10));
-    sprintf(bootLoc, "%s/boot.lua", scriptsPath);
     createLuaInstance(bootLoc);
 
     if (fatalLoadError) {
@@ -662,14 +775,7 @@ int main(int argc, char * argv[]) {
     }
 #endif // __EMSCRIPTEN__
 
-    SDL_free(appPath);
-
-    closeAudio();
-
-    GPU_FreeTarget(renderer);
-
-    GPU_Quit();
-    SDL_Quit();
+    cleanup();
 
     return exitCode;
 }
@@ -6,4 +6,10 @@
 #include "luaIncludes.h"
 
 LUALIB_API int luaopen_aud(lua_State *L);
-void closeAudio();
\ No newline at end of file
+void closeAudio();
+
+// --audio-file, records the mixer to a WAV file instead of a device. Every
+// presented frame adds 1/60 of a second.
+bool audioFileOpen(const char *path);
+void audioFileFrame();
+void audioFileClose();
@@ -5,4 +5,6 @@
 
 #include "luaIncludes.h"
 
+int fsResolvePath(lua_State *L, const char *path, char *resolved);
+
 LUALIB_API int luaopen_fs(lua_State *L);
\ No newline at end of file
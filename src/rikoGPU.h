@@ -5,4 +5,34 @@
 
 #include "luaIncludes.h"
 
-LUALIB_API int luaopen_gpu(lua_State *L);
\ No newline at end of file
+#include <stdint.h>
+
+typedef struct {
+    int width;
+    int height;
+    int rangeLow;
+    int rangeHigh;
+    // One byte per glyph pixel (1 = lit), glyphs of width * height stored back to back
+    uint8_t *glyphs;
+} fontType;
+
+extern fontType *currentFont;
+
+// A buffer of palette indices the gpu.* calls draw into, pitch bytes per row
+typedef struct {
+    uint8_t *pixels;
+    int width;
+    int height;
+    int pitch;
+} drawTarget;
+
+extern drawTarget currentTarget;
+
+void resetDrawTarget(lua_State *L);
+
+void screenMarkDirty(int x0, int y0, int x1, int y1);
+const uint8_t *checkPixelBytes(lua_State *L, int arg, int w, int h, int stride);
+const double *checkPolygon(lua_State *L, int arg, int *n);
+int batchValue(lua_State *L, int tbl, int i);
+
+LUALIB_API int luaopen_gpu(lua_State *L);
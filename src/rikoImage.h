@@ -4,5 +4,9 @@
 #define RIKO_IMAGE_NAME "image"
 
 #include "luaIncludes.h"
+#include "rikoGPU.h"
+
+// Resolves the Image at arg to its pixel storage, for gpu.setTarget
+void checkImageTarget(lua_State *L, int arg, drawTarget *t);
 
 LUALIB_API int luaopen_image(lua_State *L);
\ No newline at end of file
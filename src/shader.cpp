@@ -111,3 +111,15 @@ void updateShader() {
     GPU_DeactivateShaderProgram();
     GPU_ActivateShaderProgram(screen_shader, &screen_block);
 }
+
+// Must be called with the screen shader active
+void updateShaderPalette(int palette[16][3]) {
+    float values[16 * 3];
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 3; j++) {
+            values[i * 3 + j] = palette[i][j] / 255.f;
+        }
+    }
+
+    GPU_SetUniformfv(GPU_GetUniformLocation(screen_shader, "palette"), 3, 16, values);
+}
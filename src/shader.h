@@ -3,4 +3,5 @@
 #include "SDL_gpu/SDL_gpu.h"
 
 void initShader();
-void updateShader();
\ No newline at end of file
+void updateShader();
+void updateShaderPalette(int palette[16][3]);
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "wav.h"
+
+#include <string.h>
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+// Raw bytes decoded per read, a multiple of every frame size up to 8 channels
+#define WAV_CHUNK 6144
+
+static inline uint32_t readLE32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t readLE16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Skips bytes forward plus the pad byte of odd sized chunks. Chunk sizes go up
+// to 4GB, which doesn't fit the long fseek takes on every platform, so large
+// skips go in steps.
+static bool skipChunk(FILE *file, uint32_t bytes, bool odd) {
+    uint64_t left = (uint64_t)bytes + (odd ? 1 : 0);
+    while (left > 0) {
+        long step = left > 0x40000000 ? 0x40000000 : (long)left;
+        if (fseek(file, step, SEEK_CUR) != 0) {
+            return false;
+        }
+        left -= step;
+    }
+    return true;
+}
+
+const char *wavOpen(wavReader *wav, FILE *file) {
+    uint8_t header[12];
+    if (fread(header, 1, 12, file) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        return "not a WAV file";
+    }
+
+    bool gotFormat = false;
+    int format = 0;
+    int blockAlign = 0;
+
+    wav->file = file;
+    wav->position = 0;
+
+    uint8_t chunk[8];
+    while (fread(chunk, 1, 8, file) == 8) {
+        uint32_t size = readLE32(chunk + 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t fmt[40];
+            uint32_t want = size < sizeof(fmt) ? size : sizeof(fmt);
+            if (size < 16 || fread(fmt, 1, want, file) != want) {
+                return "bad WAV format chunk";
+            }
+
+            format = readLE16(fmt);
+            wav->channels = readLE16(fmt + 2);
+            wav->rate = (int)readLE32(fmt + 4);
+            blockAlign = readLE16(fmt + 12);
+            wav->bits = readLE16(fmt + 14);
+
+            // The sub format GUID starts with the plain format tag
+            if (format == WAVE_FORMAT_EXTENSIBLE && size >= 26) {
+                format = readLE16(fmt + 24);
+            }
+
+            if (!skipChunk(file, size - want, (size & 1) != 0)) {
+                return "bad WAV format chunk";
+            }
+            gotFormat = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!gotFormat) {
+                return "WAV data before its format";
+            }
+
+            if (format == WAVE_FORMAT_FLOAT && wav->bits == 32) {
+                wav->isFloat = true;
+            } else if (format == WAVE_FORMAT_PCM && (wav->bits == 8 || wav->bits == 16 || wav->bits == 24 || wav->bits == 32)) {
+                wav->isFloat = false;
+            } else {
+                return "unsupported WAV sample format";
+            }
+
+            if (wav->channels < 1 || wav->channels > 8 || wav->rate <= 0 || blockAlign != wav->channels * wav->bits / 8) {
+                return "bad WAV format chunk";
+            }
+
+            wav->dataStart = ftell(file);
+            wav->frames = size / blockAlign;
+            return NULL;
+        } else if (!skipChunk(file, size, (size & 1) != 0)) {
+            break;
+        }
+    }
+
+    return "WAV file has no data";
+}
+
+uint32_t wavRead(wavReader *wav, float *out, uint32_t count) {
+    uint8_t raw[WAV_CHUNK];
+    int bytes = wav->bits / 8;
+    int frameSize = bytes * wav->channels;
+    float scale = 1.0f / wav->channels;
+
+    uint32_t left = wav->frames - wav->position;
+    if (count > left) count = left;
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t want = count - done;
+        if (want > (uint32_t)(WAV_CHUNK / frameSize)) want = WAV_CHUNK / frameSize;
+
+        uint32_t got = (uint32_t)fread(raw, frameSize, want, wav->file);
+
+        const uint8_t *p = raw;
+        for (uint32_t i = 0; i < got; i++) {
+            float sum = 0;
+            for (int c = 0; c < wav->channels; c++, p += bytes) {
+                switch (bytes) {
+                case 1:
+                    sum += (p[0] - 128) * (1.0f / 128);
+                    break;
+                case 2:
+                    sum += (int16_t)readLE16(p) * (1.0f / 32768);
+                    break;
+                case 3:
+                    sum += (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) * (1.0f / 2147483648.0f);
+                    break;
+                default:
+                    if (wav->isFloat) {
+                        float f;
+                        uint32_t v = readLE32(p);
+                        memcpy(&f, &v, 4);
+                        sum += f;
+                    } else {
+                        sum += (int32_t)readLE32(p) * (1.0f / 2147483648.0f);
+                    }
+                    break;
+                }
+            }
+            out[done + i] = sum * scale;
+        }
+
+        done += got;
+        if (got < want) {
+            // Truncated file, treat what was there as all of it
+            wav->frames = wav->position + done;
+            break;
+        }
+    }
+
+    wav->position += done;
+    return done;
+}
+
+bool wavRewind(wavReader *wav) {
+    if (fseek(wav->file, wav->dataStart, SEEK_SET) != 0) {
+        return false;
+    }
+
+    wav->position = 0;
+    return true;
+}
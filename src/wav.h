@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Reads the sample data of a RIFF WAVE file a block at a time. Handles 8, 16,
+// 24 and 32 bit integer PCM and 32 bit float, and decodes to mono floats
+// since the mixer is mono, channels are averaged.
+typedef struct {
+    FILE *file;
+    int channels;
+    int rate;
+    int bits;
+    bool isFloat;
+    long dataStart;
+    uint32_t frames;
+    uint32_t position;
+} wavReader;
+
+// Parses the header of an open file, leaving it at the first frame. Returns
+// NULL, or a message saying why the file can't be played.
+const char *wavOpen(wavReader *wav, FILE *file);
+
+// Decodes up to count frames into out, returns how many it got
+uint32_t wavRead(wavReader *wav, float *out, uint32_t count);
+
+// Goes back to the first frame, for looping
+bool wavRewind(wavReader *wav);